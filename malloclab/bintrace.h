@@ -0,0 +1,28 @@
+/*
+ * bintrace.h - Binary trace file format
+ *
+ * A binary trace holds the same requests as a text (.rep) trace, but
+ * can be loaded without parsing text. It starts with the four bytes
+ * of BINTRACE_MAGIC. Everything after them is an unsigned LEB128
+ * varint, least significant 7 bits first and the high bit of each byte
+ * set if more bytes follow:
+ *
+ *   <sugg_heapsize> <num_ids> <num_ops> <weight>
+ *
+ * followed by num_ops requests, each a varint of (id << 2 | type), and
+ * for allocate and reallocate requests a second varint with the size.
+ * The converter rep2bin writes binary traces, and mdriver reads either
+ * kind, telling them apart by the magic number.
+ */
+#ifndef __BINTRACE_H_
+#define __BINTRACE_H_
+
+#define BINTRACE_MAGIC "MMT1" /* first bytes of a binary trace */
+#define BINTRACE_MAGIC_LEN 4
+
+/* Request types in the low 2 bits of a request's first varint */
+#define BINTRACE_ALLOC   0
+#define BINTRACE_FREE    1
+#define BINTRACE_REALLOC 2
+
+#endif /* __BINTRACE_H_ */
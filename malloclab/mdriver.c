@@ -14,12 +14,20 @@
 #include <string.h>
 #include <assert.h>
 #include <float.h>
+#include <limits.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "clock.h"
 #include "config.h"
+#include "bintrace.h"
 
 /**********************
  * Constants and macros
@@ -29,6 +37,19 @@
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+#define REPLAY_PASSES 10 /* times each thread replays its trace with -T */
+#define MAILBOX_MAX  256 /* blocks a thread's mailbox holds before senders wait */
+
+/* Latency histograms (-H) */
+#define HIST_PASSES     10 /* times each trace is replayed for its histogram */
+#define HIST_SUBBITS     3 /* log2 of the buckets per power of two */
+#define HIST_BUCKETS  (64 << HIST_SUBBITS)
+#define HIST_OUTLIERS    5 /* slowest requests reported per request type */
+
+/* Fragmentation profiles (-F) */
+#define FRAG_CELLS      64 /* characters in the map of the heap */
+#define FRAG_BUCKETS    64 /* free blocks are counted per power of two of size */
+#define FRAG_CLASSES    64 /* free list classes counted */
 
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((unsigned int)(p)) % ALIGNMENT) == 0)
@@ -37,11 +58,14 @@
  * The key compound data types 
  *****************************/
 
-/* Records the extent of each block's payload */
+/* Records the extent of each block's payload, as a node of a treap 
+   ordered by payload address */
 typedef struct range_t {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    unsigned int priority; /* treap priority, a hash of lo */
+    struct range_t *left;  /* payloads below this one */
+    struct range_t *right; /* payloads above this one */
 } range_t;
 
 /* Characterizes a single trace operation (allocator request) */
@@ -81,10 +105,74 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    size_t peak;     /* largest heap size during the trace (bytes) */
+    size_t final;    /* heap size at the end of the trace (bytes) */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
 
+/* 
+ * Latencies of one type of request, in cycles. Bucket i counts the 
+ * latencies from hist_lo(i) to hist_lo(i+1)-1: latencies below 
+ * 2^HIST_SUBBITS each have a bucket, and each power of two above is
+ * split into 2^HIST_SUBBITS buckets of equal width.
+ */
+typedef struct {
+    double count;          /* number of requests timed */
+    double sum;            /* their total latency */
+    double max;            /* the largest latency */
+    double buckets[HIST_BUCKETS];
+    struct {
+	double cycles;     /* latency of one of the slowest requests... */
+	int tracenum;      /* ... the trace it is in ... */
+	int opnum;         /* ... and its request number */
+    } outliers[HIST_OUTLIERS];   /* slowest first */
+    int noutliers;
+} hist_t;
+
+/* A snapshot of the heap, collected block by block from mm_walk (-F) */
+typedef struct {
+    char *heap_lo;       /* first byte of the heap */
+    size_t heap;         /* heap size */
+    size_t bytes[MM_BLOCK_KINDS]; /* bytes in the blocks of each kind */
+    int blocks[MM_BLOCK_KINDS];   /* number of blocks of each kind */
+    size_t largest;      /* largest free block */
+    int sizes[FRAG_BUCKETS];      /* free blocks per power of two of size */
+    int classes[FRAG_CLASSES];    /* free blocks on each class list... */
+    size_t class_lo[FRAG_CLASSES]; /* ... the smallest of them ... */
+    size_t class_hi[FRAG_CLASSES]; /* ... and the largest */
+    double cells[FRAG_CELLS][MM_BLOCK_KINDS]; /* bytes of each kind per cell */
+    FILE *svg;           /* if not NULL, the rows of the SVG map... */
+    int row;             /* ... and the row of this snapshot */
+    char *run;           /* run of adjacent blocks of one kind being drawn... */
+    char *run_end;       /* ... its end ... */
+    int run_kind;        /* ... and the kind */
+} snapshot_t;
+
+/* Blocks that other threads have asked a replay thread to free */
+typedef struct {
+    pthread_mutex_t lock;
+    char **blocks;   /* array of blocks waiting to be freed... */
+    int count;       /* ... the number of them, peeked at without the lock ... */
+    int max;         /* ... and the capacity of the array */
+} mailbox_t;
+
+/* Holds the params and results of one thread of a multithreaded replay */
+typedef struct {
+    int id;          /* thread number, also the index of its mailbox */
+    trace_t **traces;/* traces replayed by this thread... */
+    int ntraces;     /* ... and the number of them */
+    char *name;      /* file name of the first of them */
+    char **blocks;   /* ptrs returned by malloc/realloc, private to the thread */
+    char **spare;    /* empty array swapped into the mailbox when draining it */
+    int spare_max;   /* capacity of the spare array */
+    int use_libc;    /* replay against libc malloc instead of mm.c */
+    unsigned int seed; /* picks the frees handed to other threads */
+    double ops;      /* number of requests performed by this thread */
+    double secs;     /* time spent performing them */
+    double remote;   /* number of frees handed to other threads */
+} replay_t;
+
 /********************
  * Global variables
  *******************/
@@ -95,6 +183,18 @@ char msg[2 * MAXLINE];      /* for whenever we need to compose an error message
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
+/* Shared by the threads of a multithreaded replay (-T) */
+static int replay_threads = 0;      /* number of threads, 0 if no -T */
+static double replay_remote = 0;    /* fraction of frees done by another thread */
+static mailbox_t *mailboxes;        /* one mailbox per thread */
+static pthread_barrier_t replay_start; /* lets the threads start at once */
+static int replay_done;             /* number of threads done replaying */
+static pthread_mutex_t mm_lock = PTHREAD_MUTEX_INITIALIZER; /* guards mm.c */
+
+/* Fragmentation profiles (-F) */
+static int frag_interval = 0;       /* requests between snapshots, 0 if no -F */
+static char *frag_svg = NULL;       /* prefix of the SVG maps, NULL if no -S */
+
 /* The filenames of the default tracefiles */
 static char *default_tracefiles[] = {  
     DEFAULT_TRACEFILES, NULL
@@ -110,9 +210,18 @@ static int add_range(range_t **ranges, char *lo, int size,
 		     int tracenum, int opnum);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
+static range_t *insert_node(range_t *root, range_t *p);
+static range_t *remove_node(range_t *root, char *lo);
+static range_t *merge_nodes(range_t *a, range_t *b);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
+static trace_t *read_bintrace(char *path);
+static unsigned long get_varint(unsigned char **p, unsigned char *end, 
+				char *path);
+static int get_int(unsigned char **p, unsigned char *end, char *path);
+static void bintrace_error(char *path);
+static void alloc_trace_arrays(trace_t *trace);
 static void free_trace(trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
@@ -122,8 +231,41 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
+static double eval_mm_util(trace_t *trace, size_t *peak, size_t *final);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_latency(trace_t *trace, int tracenum, hist_t *hists);
+
+/* Collect and print latency histograms */
+static double counter_overhead(void);
+static void hist_add(hist_t *hist, double cycles, int tracenum, int opnum);
+static int hist_index(unsigned long long cycles);
+static unsigned long long hist_lo(int i);
+static double hist_percentile(hist_t *hist, double p);
+static void printhists(hist_t *hists, char **tracefiles);
+
+/* Print the statistics mm.c keeps */
+static void printstats(char *tracefile);
+
+/* Profile the fragmentation of the heap */
+static void eval_mm_frag(trace_t *trace, int tracenum, char *tracefile);
+static void frag_snapshot(snapshot_t *snap, FILE *svg, int row);
+static void frag_block(void *arg, void *ptr, size_t size, int kind, int cls);
+static void frag_draw_run(snapshot_t *snap);
+static void frag_write_svg(FILE *body, int rows, size_t max_heap, 
+			   int tracenum, char *tracefile);
+static void printsnapshot(snapshot_t *snap, int opnum);
+static void printfrag(snapshot_t *snap, int opnum);
+
+/* Replays traces on several threads at once */
+static void eval_threads(char **tracefiles, int num_tracefiles, int run_libc);
+static double replay(trace_t **traces, char **tracefiles, int ntraces, 
+		     int use_libc);
+static void *replay_thread(void *vargp);
+static void replay_free(replay_t *r, char *p);
+static void drain_mailbox(replay_t *r);
+static void *replay_malloc_fn(int use_libc, size_t size);
+static void *replay_realloc_fn(int use_libc, void *ptr, size_t size);
+static void replay_free_fn(int use_libc, void *ptr);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
@@ -150,6 +292,9 @@ int main(int argc, char **argv)
     int team_check = 1;  /* If set, check team structure (reset by -a) */
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    int latency = 0;     /* If set, time each request of mm malloc (-H) */
+    int stats = 0;       /* If set, print the statistics of mm malloc (-s) */
+    hist_t *hists = NULL;/* latency histograms, one per type of request */
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -158,7 +303,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:T:x:F:S:hvVgalHs")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -178,12 +323,42 @@ int main(int argc, char **argv)
 	    if (tracedir[strlen(tracedir)-1] != '/') 
 		strcat(tracedir, "/"); /* path always ends with "/" */
 	    break;
+	case 'T': /* Replay the traces on this many threads at once */
+	    replay_threads = atoi(optarg);
+	    if (replay_threads < 1) {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'x': /* Fraction of frees made by another thread with -T */
+	    replay_remote = atof(optarg);
+	    if (replay_remote < 0 || replay_remote > 1) {
+		usage();
+		exit(1);
+	    }
+	    break;
         case 'a': /* Don't check team structure */
             team_check = 0;
             break;
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+	case 'H': /* Print latency histograms */
+	    latency = 1;
+	    break;
+	case 's': /* Print the statistics of mm malloc */
+	    stats = 1;
+	    break;
+	case 'F': /* Print the fragmentation every this many requests */
+	    frag_interval = atoi(optarg);
+	    if (frag_interval < 1) {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'S': /* With -F, draw the heap to SVG files with this prefix */
+	    frag_svg = strdup(optarg);
+	    break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -235,6 +410,12 @@ int main(int argc, char **argv)
 	printf("Using default tracefiles in %s\n", tracedir);
     }
 
+    /* With -T, measure scalability instead of the performance index */
+    if (replay_threads > 0) {
+	eval_threads(tracefiles, num_tracefiles, run_libc);
+	exit(errors ? 1 : 0);
+    }
+
     /* Initialize the timing package */
     init_fsecs();
 
@@ -284,6 +465,10 @@ int main(int argc, char **argv)
     if (mm_stats == NULL)
 	unix_error("mm_stats calloc in main failed");
     
+    /* Allocate the latency histograms */
+    if (latency && (hists = (hist_t *)calloc(3, sizeof(hist_t))) == NULL)
+	unix_error("hists calloc in main failed");
+
     /* Initialize the simulated memory system in memlib.c */
     mem_init(); 
 
@@ -297,12 +482,19 @@ int main(int argc, char **argv)
 	if (mm_stats[i].valid) {
 	    if (verbose > 1)
 		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
+	    mm_stats[i].util = eval_mm_util(trace, &mm_stats[i].peak,
+					    &mm_stats[i].final);
+	    if (stats)
+		printstats(tracefiles[i]);
 	    speed_params.trace = trace;
 	    speed_params.ranges = ranges;
 	    if (verbose > 1)
 		printf("and performance.\n");
 	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+	    if (latency)
+		eval_mm_latency(trace, i, hists);
+	    if (frag_interval)
+		eval_mm_frag(trace, i, tracefiles[i]);
 	}
 	free_trace(trace);
     }
@@ -314,6 +506,12 @@ int main(int argc, char **argv)
 	printf("\n");
     }
 
+    /* Display the latency of each type of request */
+    if (latency) {
+	printhists(hists, tracefiles);
+	printf("\n");
+    }
+
     /* 
      * Accumulate the aggregate statistics for the student's mm package 
      */
@@ -367,9 +565,12 @@ int main(int argc, char **argv)
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps 
+ * The following routines manipulate the range tree, which keeps 
  * track of the extent of every allocated block payload. We use the 
- * range list to detect any overlapping allocated blocks.
+ * range tree to detect any overlapping allocated blocks. It is a
+ * treap ordered by payload address, so since the payloads in it never
+ * overlap, a new payload only has to be checked against its two
+ * neighbors, and every operation takes O(log n) expected time.
  ****************************************************************/
 
 /*
@@ -382,7 +583,7 @@ static int add_range(range_t **ranges, char *lo, int size,
 		     int tracenum, int opnum)
 {
     char *hi = lo + size - 1;
-    range_t *p;
+    range_t *p, *below = NULL, *above = NULL;
     char msg[MAXLINE];
 
     assert(size > 0);
@@ -395,36 +596,54 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap or a mapping */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
+	 (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+	!mem_is_mapped(lo, hi)) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
         return 0;
     }
 
-    /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-	    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-		    lo, hi, p->lo, p->hi);
-	    malloc_error(tracenum, opnum, msg);
-	    return 0;
-        }
+    /* 
+     * The payload must not overlap any other payloads. Find the payloads
+     * that start last at or below lo and first above it.
+     */
+    for (p = *ranges;  p != NULL; ) {
+	if (p->lo <= lo) {
+	    below = p;
+	    p = p->right;
+	}
+	else {
+	    above = p;
+	    p = p->left;
+	}
+    }
+    if (below != NULL && below->hi >= lo)
+	p = below;
+    else if (above != NULL && above->lo <= hi)
+	p = above;
+    else
+	p = NULL;
+    if (p != NULL) {
+	sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+		lo, hi, p->lo, p->hi);
+	malloc_error(tracenum, opnum, msg);
+	return 0;
     }
 
     /* 
      * Everything looks OK, so remember the extent of this block 
-     * by creating a range struct and adding it the range list.
+     * by creating a range struct and adding it the range tree.
      */
     if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
 	unix_error("malloc error in add_range");
-    p->next = *ranges;
     p->lo = lo;
     p->hi = hi;
-    *ranges = p;
+    p->priority = (unsigned int)(((unsigned long)lo >> 3) * 2654435761u);
+    p->left = p->right = NULL;
+    *ranges = insert_node(*ranges, p);
     return 1;
 }
 
@@ -433,34 +652,93 @@ static int add_range(range_t **ranges, char *lo, int size,
  */
 static void remove_range(range_t **ranges, char *lo)
 {
-    range_t *p;
-    range_t **prevpp = ranges;
-    // int size;
-
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-            *prevpp = p->next;
-            // size = p->hi - p->lo + 1;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
-    }
+    *ranges = remove_node(*ranges, lo);
 }
 
 /*
  * clear_ranges - free all of the range records for a trace 
  */
 static void clear_ranges(range_t **ranges)
+{
+    range_t *p = *ranges;
+
+    if (p == NULL)
+	return;
+    clear_ranges(&p->left);
+    clear_ranges(&p->right);
+    free(p);
+    *ranges = NULL;
+}
+
+/*
+ * insert_node - Insert range p into the subtree at root and return the
+ *     new root of the subtree
+ */
+static range_t *insert_node(range_t *root, range_t *p)
+{
+    range_t *child;
+
+    if (root == NULL)
+	return p;
+
+    /* Insert below, then rotate the child up if it has higher priority */
+    if (p->lo < root->lo) {
+	child = root->left = insert_node(root->left, p);
+	if (child->priority > root->priority) {
+	    root->left = child->right;
+	    child->right = root;
+	    return child;
+	}
+    }
+    else {
+	child = root->right = insert_node(root->right, p);
+	if (child->priority > root->priority) {
+	    root->right = child->left;
+	    child->left = root;
+	    return child;
+	}
+    }
+    return root;
+}
+
+/*
+ * remove_node - Free the range starting at lo, if any, from the subtree
+ *     at root and return the new root of the subtree
+ */
+static range_t *remove_node(range_t *root, char *lo)
 {
     range_t *p;
-    range_t *pnext;
 
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
+    if (root == NULL)
+	return NULL;
+    if (root->lo == lo) {
+	p = merge_nodes(root->left, root->right);
+	free(root);
+	return p;
     }
-    *ranges = NULL;
+    if (lo < root->lo)
+	root->left = remove_node(root->left, lo);
+    else
+	root->right = remove_node(root->right, lo);
+    return root;
+}
+
+/*
+ * merge_nodes - Join subtrees a and b, where every range in a lies
+ *     below every range in b, and return the root of the result
+ */
+static range_t *merge_nodes(range_t *a, range_t *b)
+{
+    if (a == NULL)
+	return b;
+    if (b == NULL)
+	return a;
+    if (a->priority > b->priority) {
+	a->right = merge_nodes(a->right, b);
+	return a;
+    }
+    b->left = merge_nodes(a, b->left);
+    return b;
 }
 
 
@@ -469,7 +747,7 @@ static void clear_ranges(range_t **ranges)
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * read_trace - read a trace file, text or binary, and store it in memory
  */
 static trace_t *read_trace(char *tracedir, char *filename)
 {
@@ -495,25 +773,21 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	sprintf(msg, "Could not open %s in read_trace", path);
 	unix_error(msg);
     }
+
+    /* Binary traces are decoded without going through stdio */
+    if (fread(type, 1, BINTRACE_MAGIC_LEN, tracefile) == BINTRACE_MAGIC_LEN &&
+	!memcmp(type, BINTRACE_MAGIC, BINTRACE_MAGIC_LEN)) {
+	fclose(tracefile);
+	free(trace);
+	return read_bintrace(path);
+    }
+    rewind(tracefile);
+
     fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
     fscanf(tracefile, "%d", &(trace->num_ids));     
     fscanf(tracefile, "%d", &(trace->num_ops));     
     fscanf(tracefile, "%d", &(trace->weight));        /* not used */
-    
-    /* We'll store each request line in the trace in this array */
-    if ((trace->ops = 
-	 (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
-	unix_error("malloc 2 failed in read_trace");
-
-    /* We'll keep an array of pointers to the allocated blocks here... */
-    if ((trace->blocks = 
-	 (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
-	unix_error("malloc 3 failed in read_trace");
-
-    /* ... along with the corresponding byte sizes of each block */
-    if ((trace->block_sizes = 
-	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
-	unix_error("malloc 4 failed in read_trace");
+    alloc_trace_arrays(trace);
     
     /* read every request line in the trace file */
     index = 0;
@@ -554,6 +828,138 @@ static trace_t *read_trace(char *tracedir, char *filename)
     return trace;
 }
 
+/*
+ * read_bintrace - read a binary trace (see bintrace.h) into a newly
+ *     allocated trace_t. The file is mapped and its requests decoded 
+ *     in a single pass.
+ */
+static trace_t *read_bintrace(char *path)
+{
+    trace_t *trace;
+    struct stat st;
+    unsigned char *start, *p, *end;
+    unsigned long word, index, max_index = 0;
+    int fd, i;
+
+    if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
+	unix_error("malloc failed in read_bintrace");
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+	sprintf(msg, "Could not open %s in read_bintrace", path);
+	unix_error(msg);
+    }
+    start = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (start == MAP_FAILED) {
+	sprintf(msg, "Could not map %s in read_bintrace", path);
+	unix_error(msg);
+    }
+    close(fd);
+    madvise(start, st.st_size, MADV_SEQUENTIAL);
+    p = start + BINTRACE_MAGIC_LEN;
+    end = start + st.st_size;
+
+    trace->sugg_heapsize = get_int(&p, end, path); /* not used */
+    trace->num_ids = get_int(&p, end, path);
+    trace->num_ops = get_int(&p, end, path);
+    trace->weight = get_int(&p, end, path);        /* not used */
+
+    /* Every request takes at least a byte, and names a block id */
+    if (trace->num_ops > end - p || trace->num_ids == 0)
+	bintrace_error(path);
+    alloc_trace_arrays(trace);
+
+    for (i = 0; i < trace->num_ops; i++) {
+	word = get_varint(&p, end, path);
+	index = word >> 2;
+	if (index >= (unsigned long)trace->num_ids)
+	    bintrace_error(path);
+	trace->ops[i].index = index;
+	switch (word & 3) {
+	case BINTRACE_ALLOC:
+	    trace->ops[i].type = ALLOC;
+	    trace->ops[i].size = get_int(&p, end, path);
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
+	case BINTRACE_REALLOC:
+	    trace->ops[i].type = REALLOC;
+	    trace->ops[i].size = get_int(&p, end, path);
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
+	case BINTRACE_FREE:
+	    trace->ops[i].type = FREE;
+	    break;
+	default:
+	    printf("Bogus request type (%lu) in tracefile %s\n", word & 3, path);
+	    exit(1);
+	}
+    }
+    if (max_index != trace->num_ids - 1 || p != end)
+	bintrace_error(path);
+    munmap(start, st.st_size);
+
+    return trace;
+}
+
+/*
+ * get_varint - decode the varint at *p and advance *p past it
+ */
+static unsigned long get_varint(unsigned char **p, unsigned char *end, 
+				char *path)
+{
+    unsigned long val = 0;
+    int shift = 0;
+
+    do {
+	if (*p == end || shift > 63)
+	    bintrace_error(path);
+	val |= (unsigned long)(**p & 0x7f) << shift;
+	shift += 7;
+    } while (*(*p)++ & 0x80);
+    return val;
+}
+
+/*
+ * get_int - decode the varint at *p, which must fit in an int
+ */
+static int get_int(unsigned char **p, unsigned char *end, char *path)
+{
+    unsigned long val = get_varint(p, end, path);
+
+    if (val > INT_MAX)
+	bintrace_error(path);
+    return val;
+}
+
+/*
+ * bintrace_error - reject a binary trace that cannot be decoded
+ */
+static void bintrace_error(char *path)
+{
+    printf("Truncated or corrupt tracefile %s\n", path);
+    exit(1);
+}
+
+/*
+ * alloc_trace_arrays - allocate the arrays of a trace whose header 
+ *     has been read
+ */
+static void alloc_trace_arrays(trace_t *trace)
+{
+    /* We'll store each request line in the trace in this array */
+    if ((trace->ops = 
+	 (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
+	unix_error("malloc 2 failed in read_trace");
+
+    /* We'll keep an array of pointers to the allocated blocks here... */
+    if ((trace->blocks = 
+	 (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
+	unix_error("malloc 3 failed in read_trace");
+
+    /* ... along with the corresponding byte sizes of each block */
+    if ((trace->block_sizes = 
+	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
+	unix_error("malloc 4 failed in read_trace");
+}
+
 /*
  * free_trace - Free the trace record and the three arrays it points
  *              to, all of which were allocated in read_trace().
@@ -653,7 +1059,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    oldsize = trace->block_sizes[index];
 	    if (size < oldsize) oldsize = size;
 	    for (j = 0; j < oldsize; j++) {
-	      if (newp[j] != (index & 0xFF)) {
+	      if ((unsigned char)newp[j] != (index & 0xFF)) {
 		malloc_error(tracenum, i, "mm_realloc did not preserve the "
 			     "data from old block");
 		return 0;
@@ -689,13 +1095,13 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
+ *   largest number of bytes held in the heap and in mappings while
+ *   running the student's malloc package on the trace. Since the heap
+ *   can shrink and mappings can be released, the peak and final sizes
+ *   are returned in *peak and *final.
  *   
  */
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
+static double eval_mm_util(trace_t *trace, size_t *peak, size_t *final)
 {   
     int i;
     int index;
@@ -774,7 +1180,9 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
         }
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    *peak = mem_peak_heapsize();
+    *final = mem_heapsize() + mem_mapsize();
+    return ((double)max_total_size / (double)mem_peak_heapsize());
 }
 
 
@@ -825,6 +1233,259 @@ static void eval_mm_speed(void *ptr)
         }
 }
 
+/*
+ * eval_mm_latency - Replay the trace HIST_PASSES times, timing each 
+ *     mm_malloc, mm_free and mm_realloc call with the cycle counter, and
+ *     add the latencies to the histogram for its type of request
+ */
+static void eval_mm_latency(trace_t *trace, int tracenum, hist_t *hists)
+{
+    int i, j, index, size;
+    char *p;
+    double start, cycles, overhead = counter_overhead();
+
+    for (j = 0; j < HIST_PASSES; j++) {
+	/* Reset the heap and initialize the mm package */
+	mem_reset_brk();
+	if (mm_init() < 0) 
+	    app_error("mm_init failed in eval_mm_latency");
+
+	for (i = 0;  i < trace->num_ops;  i++) {
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+	    switch (trace->ops[i].type) {
+
+	    case ALLOC: /* mm_malloc */
+		start = read_counter();
+		p = mm_malloc(size);
+		cycles = read_counter() - start;
+		if (p == NULL)
+		    app_error("mm_malloc error in eval_mm_latency");
+		trace->blocks[index] = p;
+		break;
+
+	    case REALLOC: /* mm_realloc */
+		start = read_counter();
+		p = mm_realloc(trace->blocks[index], size);
+		cycles = read_counter() - start;
+		if (p == NULL)
+		    app_error("mm_realloc error in eval_mm_latency");
+		trace->blocks[index] = p;
+		break;
+
+	    case FREE: /* mm_free */
+		start = read_counter();
+		mm_free(trace->blocks[index]);
+		cycles = read_counter() - start;
+		break;
+
+	    default:
+		app_error("Nonexistent request type in eval_mm_latency");
+	    }
+	    cycles = cycles > overhead ? cycles - overhead : 0;
+	    hist_add(&hists[trace->ops[i].type], cycles, tracenum, i);
+	}
+    }
+}
+
+/*
+ * eval_mm_frag - Replay the trace, taking a snapshot of the heap every
+ *     frag_interval requests and after the last one. Print a line for 
+ *     each snapshot, and the free blocks of the one with the most bytes
+ *     allocated, which is where fragmentation costs utilization. With
+ *     -S, also draw every snapshot as a row of an SVG map.
+ */
+static void eval_mm_frag(trace_t *trace, int tracenum, char *tracefile)
+{
+    int i, index, rows = 0, worst_op = 0;
+    char *p;
+    snapshot_t *snap, *worst;
+    FILE *svg = NULL;
+    size_t max_heap = 0;
+
+    if ((snap = malloc(sizeof(snapshot_t))) == NULL ||
+	(worst = calloc(1, sizeof(snapshot_t))) == NULL)
+	unix_error("malloc failed in eval_mm_frag");
+    if (frag_svg && (svg = tmpfile()) == NULL)
+	unix_error("tmpfile failed in eval_mm_frag");
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0) 
+	app_error("mm_init failed in eval_mm_frag");
+
+    printf("\nFragmentation of mm malloc on %s, every %d requests:\n",
+	   tracefile, frag_interval);
+    printf("%10s%10s%10s%10s%10s%8s%10s%6s  %s\n", "request", "heap KB",
+	   "alloc KB", "free KB", "quick KB", "free", "largest", "ext",
+	   "map (# alloc . free q quick s slab)");
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	switch (trace->ops[i].type) {
+
+	case ALLOC: /* mm_malloc */
+	    if ((p = mm_malloc(trace->ops[i].size)) == NULL)
+		app_error("mm_malloc error in eval_mm_frag");
+	    trace->blocks[index] = p;
+	    break;
+
+	case REALLOC: /* mm_realloc */
+	    p = mm_realloc(trace->blocks[index], trace->ops[i].size);
+	    if (p == NULL)
+		app_error("mm_realloc error in eval_mm_frag");
+	    trace->blocks[index] = p;
+	    break;
+
+	case FREE: /* mm_free */
+	    mm_free(trace->blocks[index]);
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_frag");
+	}
+
+	if ((i + 1) % frag_interval != 0 && i != trace->num_ops - 1)
+	    continue;
+	frag_snapshot(snap, svg, rows++);
+	printsnapshot(snap, i + 1);
+	if (snap->bytes[MM_BLOCK_ALLOC] + snap->bytes[MM_BLOCK_SLAB] >=
+	    worst->bytes[MM_BLOCK_ALLOC] + worst->bytes[MM_BLOCK_SLAB]) {
+	    *worst = *snap;
+	    worst_op = i + 1;
+	}
+	if (snap->heap > max_heap)
+	    max_heap = snap->heap;
+    }
+    printfrag(worst, worst_op);
+
+    if (svg) {
+	frag_write_svg(svg, rows, max_heap, tracenum, tracefile);
+	fclose(svg);
+    }
+    free(snap);
+    free(worst);
+}
+
+/*
+ * frag_snapshot - Walk the heap into *snap, drawing it as a row of the
+ *     SVG map if svg is not NULL
+ */
+static void frag_snapshot(snapshot_t *snap, FILE *svg, int row)
+{
+    memset(snap, 0, sizeof(snapshot_t));
+    snap->heap_lo = mem_heap_lo();
+    snap->heap = mem_heapsize();
+    snap->svg = svg;
+    snap->row = row;
+    mm_walk(frag_block, snap);
+    frag_draw_run(snap);
+}
+
+/*
+ * frag_block - Add a block reported by mm_walk to the snapshot
+ */
+static void frag_block(void *arg, void *ptr, size_t size, int kind, int cls)
+{
+    snapshot_t *snap = (snapshot_t *)arg;
+    char *lo = (char *)ptr;
+    double width = (double)snap->heap / FRAG_CELLS;
+    double start = lo - snap->heap_lo, end = start + size;
+    int c;
+
+    snap->bytes[kind] += size;
+    snap->blocks[kind]++;
+    if (kind == MM_BLOCK_FREE) {
+	if (size > snap->largest)
+	    snap->largest = size;
+	snap->sizes[63 - __builtin_clzll((unsigned long long)size)]++;
+	if (cls >= 0 && cls < FRAG_CLASSES) {
+	    if (snap->classes[cls]++ == 0 || size < snap->class_lo[cls])
+		snap->class_lo[cls] = size;
+	    if (size > snap->class_hi[cls])
+		snap->class_hi[cls] = size;
+	}
+    }
+
+    /* Spread the block over the cells of the map that it covers */
+    for (c = start / width; c < FRAG_CELLS && c * width < end; c++)
+	snap->cells[c][kind] += (end < (c + 1) * width ? end : (c + 1) * width) -
+	    (start > c * width ? start : c * width);
+
+    /* Draw adjacent blocks of the same kind as one rectangle */
+    if (snap->svg) {
+	if (snap->run == NULL || kind != snap->run_kind || lo != snap->run_end) {
+	    frag_draw_run(snap);
+	    snap->run = lo;
+	    snap->run_kind = kind;
+	}
+	snap->run_end = lo + size;
+    }
+}
+
+/*
+ * frag_draw_run - Draw the current run of blocks of a snapshot
+ */
+static void frag_draw_run(snapshot_t *snap)
+{
+    static char *colors[MM_BLOCK_KINDS] = 
+	{"#4e79a7", "#e15759", "#f28e2b", "#59a14f"};
+
+    if (snap->svg == NULL || snap->run == NULL)
+	return;
+    fprintf(snap->svg, "<rect x=\"%lu\" y=\"%d\" width=\"%lu\" height=\"1\" "
+	    "fill=\"%s\"/>\n", (unsigned long)(snap->run - snap->heap_lo), 
+	    snap->row, (unsigned long)(snap->run_end - snap->run), 
+	    colors[snap->run_kind]);
+    snap->run = NULL;
+}
+
+/*
+ * frag_write_svg - Write the SVG map of a trace to <prefix><tracenum>.svg:
+ *     one row per snapshot, top to bottom, with the heap addresses from 
+ *     left to right, scaled to the largest heap
+ */
+static void frag_write_svg(FILE *body, int rows, size_t max_heap, 
+			   int tracenum, char *tracefile)
+{
+    static char *names[MM_BLOCK_KINDS] = {"allocated", "free", "quick", "slab"};
+    static char *colors[MM_BLOCK_KINDS] = 
+	{"#4e79a7", "#e15759", "#f28e2b", "#59a14f"};
+    char path[MAXLINE], buf[BUFSIZ];
+    FILE *fp;
+    size_t n;
+    int i, height = rows * 4;
+
+    if (height < 40)
+	height = 40;
+    if (height > 2000)
+	height = 2000;
+    sprintf(path, "%s%d.svg", frag_svg, tracenum);
+    if ((fp = fopen(path, "w")) == NULL)
+	unix_error("Could not create the SVG map in frag_write_svg");
+
+    fprintf(fp, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"1000\" "
+	    "height=\"%d\" font-family=\"monospace\" font-size=\"12\">\n", 
+	    height + 50);
+    fprintf(fp, "<text x=\"0\" y=\"14\">%s: %d snapshots, every %d requests, "
+	    "of a heap of up to %lu KB</text>\n", tracefile, rows, 
+	    frag_interval, (unsigned long)(max_heap / 1024));
+    fprintf(fp, "<svg x=\"0\" y=\"22\" width=\"1000\" height=\"%d\" "
+	    "viewBox=\"0 0 %lu %d\" preserveAspectRatio=\"none\" "
+	    "shape-rendering=\"crispEdges\">\n", height, 
+	    (unsigned long)(max_heap ? max_heap : 1), rows);
+    rewind(body);
+    while ((n = fread(buf, 1, sizeof(buf), body)) > 0)
+	fwrite(buf, 1, n, fp);
+    fprintf(fp, "</svg>\n");
+    for (i = 0; i < MM_BLOCK_KINDS; i++)
+	fprintf(fp, "<rect x=\"%d\" y=\"%d\" width=\"10\" height=\"10\" "
+		"fill=\"%s\"/><text x=\"%d\" y=\"%d\">%s</text>\n", 
+		i * 120, height + 30, colors[i], i * 120 + 14, height + 39, names[i]);
+    fprintf(fp, "</svg>\n");
+    if (fclose(fp) != 0)
+	unix_error("Could not write the SVG map in frag_write_svg");
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -910,6 +1571,353 @@ static void eval_libc_speed(void *ptr)
     }
 }
 
+/**********************************************************************
+ * The following functions replay traces on several threads at once
+ * (-T). The traces are dealt round-robin, so thread i replays traces i,
+ * i + n, i + 2n and so on for n threads. With fewer traces than threads,
+ * thread i replays trace i mod the number of traces, so a single trace
+ * (-f) is replayed whole by every thread rather than split into shards.
+ * Each thread uses ids of its own for its blocks. A fraction of
+ * the frees (-x) is handed to a randomly chosen other thread, which
+ * makes them the next time it looks in its mailbox. mm.c is called
+ * under a global lock unless it was built with -DMM_THREAD_SAFE.
+ **********************************************************************/
+
+/*
+ * eval_threads - Check the traces on one thread, then report the 
+ *     throughput and per-request latency of each thread replaying them
+ *     concurrently, for mm malloc and optionally libc malloc
+ */
+static void eval_threads(char **tracefiles, int num_tracefiles, int run_libc)
+{
+    trace_t **traces;
+    range_t *ranges = NULL;
+    int i, ntraces = num_tracefiles;
+    double mm_rate, libc_rate = 0;
+
+    if ((traces = calloc(ntraces, sizeof(trace_t *))) == NULL)
+	unix_error("calloc in eval_threads failed");
+    if ((mailboxes = calloc(replay_threads, sizeof(mailbox_t))) == NULL)
+	unix_error("calloc in eval_threads failed");
+    for (i = 0; i < replay_threads; i++)
+	pthread_mutex_init(&mailboxes[i].lock, NULL);
+    pthread_barrier_init(&replay_start, NULL, replay_threads);
+
+    /* A trace that fails on one thread will not pass on several */
+    mem_init();
+    for (i = 0; i < ntraces; i++) {
+	traces[i] = read_trace(tracedir, tracefiles[i]);
+	if (!eval_mm_valid(traces[i], i, &ranges)) {
+	    printf("Terminated with %d errors\n", errors);
+	    return;
+	}
+    }
+    clear_ranges(&ranges);
+
+    printf("Replaying %d trace%s on %d thread%s, %.0f%% of frees by "
+	   "another thread\n", ntraces, ntraces == 1 ? "" : "s",
+	   replay_threads, replay_threads == 1 ? "" : "s",
+	   replay_remote * 100);
+
+    printf("\nResults for mm malloc%s:\n",
+	   mm_thread_safe ? "" : " (under a global lock)");
+    mm_rate = replay(traces, tracefiles, ntraces, 0);
+    if (run_libc) {
+	printf("\nResults for libc malloc:\n");
+	libc_rate = replay(traces, tracefiles, ntraces, 1);
+    }
+
+    printf("\nmm malloc: %.0f Kops/sec", mm_rate / 1e3);
+    if (run_libc)
+	printf(", libc malloc: %.0f Kops/sec", libc_rate / 1e3);
+    printf("\n");
+
+    for (i = 0; i < ntraces; i++)
+	free_trace(traces[i]);
+    free(traces);
+    for (i = 0; i < replay_threads; i++) {
+	pthread_mutex_destroy(&mailboxes[i].lock);
+	free(mailboxes[i].blocks);
+    }
+    free(mailboxes);
+    pthread_barrier_destroy(&replay_start);
+    mem_deinit();
+}
+
+/*
+ * replay - Run one replay thread per -T on a fresh heap, print what 
+ *     each thread did, and return the aggregate requests per second
+ */
+static double replay(trace_t **traces, char **tracefiles, int ntraces, 
+		     int use_libc)
+{
+    pthread_t *tids;
+    replay_t *params;
+    struct timespec start, end;
+    double ops = 0, secs;
+    char label[MAXLINE];
+    int i, j, max_ids;
+
+    tids = malloc(replay_threads * sizeof(pthread_t));
+    params = calloc(replay_threads, sizeof(replay_t));
+    if (tids == NULL || params == NULL)
+	unix_error("malloc in replay failed");
+
+    if (!use_libc) {
+	mem_reset_brk();
+	if (mm_init() < 0)
+	    app_error("mm_init failed in replay");
+    }
+
+    for (i = 0; i < replay_threads; i++) {
+	params[i].id = i;
+	params[i].ntraces = i < ntraces ? 
+	    (ntraces - i + replay_threads - 1) / replay_threads : 1;
+	params[i].traces = malloc(params[i].ntraces * sizeof(trace_t *));
+	if (params[i].traces == NULL)
+	    unix_error("malloc in replay failed");
+	for (j = 0, max_ids = 1; j < params[i].ntraces; j++) {
+	    params[i].traces[j] = traces[(i + j * replay_threads) % ntraces];
+	    if (params[i].traces[j]->num_ids > max_ids)
+		max_ids = params[i].traces[j]->num_ids;
+	}
+	params[i].name = tracefiles[i % ntraces];
+	params[i].use_libc = use_libc;
+	params[i].seed = 2654435761u * (i + 1);
+	params[i].blocks = calloc(max_ids, sizeof(char *));
+	if (params[i].blocks == NULL)
+	    unix_error("calloc in replay failed");
+    }
+
+    replay_done = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < replay_threads; i++)
+	if (pthread_create(&tids[i], NULL, replay_thread, &params[i]) != 0)
+	    unix_error("pthread_create in replay failed");
+    for (i = 0; i < replay_threads; i++)
+	pthread_join(tids[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("%6s %-20s %10s %10s %8s %8s\n", 
+	   "thread", "trace", "ops", "secs", "ns/op", "remote");
+    for (i = 0; i < replay_threads; i++) {
+	if (params[i].ntraces > 1)
+	    sprintf(label, "%s +%d", params[i].name, params[i].ntraces - 1);
+	else
+	    strcpy(label, params[i].name);
+	printf("%6d %-20s %10.0f %10.6f %8.1f %8.0f\n", i, label,
+	       params[i].ops, params[i].secs, 
+	       params[i].secs * 1e9 / params[i].ops, params[i].remote);
+	ops += params[i].ops;
+	free(params[i].traces);
+	free(params[i].blocks);
+	free(params[i].spare);
+    }
+    printf("%6s %-20s %10.0f %10.6f %8.1f\n", "total", "", ops, secs,
+	   secs * 1e9 * replay_threads / ops);
+
+    free(tids);
+    free(params);
+    return ops / secs;
+}
+
+/*
+ * replay_thread - Replay the thread's traces REPLAY_PASSES times, then 
+ *     free what the other threads hand over until every thread is done
+ */
+static void *replay_thread(void *vargp)
+{
+    replay_t *r = (replay_t *)vargp;
+    trace_t *trace;
+    struct timespec start, end;
+    int i, j, k, index, done;
+    char *p;
+
+    pthread_barrier_wait(&replay_start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (j = 0; j < REPLAY_PASSES; j++) {
+	for (k = 0; k < r->ntraces; k++) {
+	    trace = r->traces[k];
+	    for (i = 0; i < trace->num_ops; i++) {
+		index = trace->ops[i].index;
+		switch (trace->ops[i].type) {
+
+		case ALLOC: /* malloc */
+		    p = replay_malloc_fn(r->use_libc, trace->ops[i].size);
+		    if (p == NULL)
+			app_error("malloc error in replay_thread (is MAX_HEAP large "
+				  "enough for this many threads?)");
+		    r->blocks[index] = p;
+		    r->ops++;
+		    break;
+
+		case REALLOC: /* realloc */
+		    p = replay_realloc_fn(r->use_libc, r->blocks[index], 
+					  trace->ops[i].size);
+		    if (p == NULL)
+			app_error("realloc error in replay_thread (is MAX_HEAP large "
+				  "enough for this many threads?)");
+		    r->blocks[index] = p;
+		    r->ops++;
+		    break;
+
+		case FREE: /* free, possibly by another thread */
+		    replay_free(r, r->blocks[index]);
+		    r->blocks[index] = NULL;
+		    break;
+
+		default:
+		    app_error("Nonexistent request type in replay_thread");
+		}
+		if (__atomic_load_n(&mailboxes[r->id].count, __ATOMIC_RELAXED))
+		    drain_mailbox(r);
+	    }
+
+	    /* Start the next trace with none of this one's blocks */
+	    for (index = 0; index < trace->num_ids; index++)
+		if (r->blocks[index] != NULL) {
+		    replay_free(r, r->blocks[index]);
+		    r->blocks[index] = NULL;
+		}
+	}
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    r->secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    /* Keep freeing handed-over blocks, lest they pile up, until every 
+       thread is done and nothing more can be handed over. Only the 
+       time spent freeing them counts. */
+    __atomic_add_fetch(&replay_done, 1, __ATOMIC_SEQ_CST);
+    do {
+	done = __atomic_load_n(&replay_done, __ATOMIC_SEQ_CST) == replay_threads;
+	if (__atomic_load_n(&mailboxes[r->id].count, __ATOMIC_RELAXED)) {
+	    clock_gettime(CLOCK_MONOTONIC, &start);
+	    drain_mailbox(r);
+	    clock_gettime(CLOCK_MONOTONIC, &end);
+	    r->secs += (end.tv_sec - start.tv_sec) + 
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+	}
+	else if (!done)
+	    sched_yield();
+    } while (!done);
+    return NULL;
+}
+
+/*
+ * replay_free - Free block p, or with probability -x, put it in the
+ *     mailbox of another thread to be freed there. A sender finding the
+ *     mailbox full drains its own while it waits, so that blocks cannot
+ *     pile up faster than they are freed.
+ */
+static void replay_free(replay_t *r, char *p)
+{
+    mailbox_t *box;
+    int other;
+
+    if (replay_threads == 1 || 
+	rand_r(&r->seed) >= replay_remote * ((double)RAND_MAX + 1)) {
+	replay_free_fn(r->use_libc, p);
+	r->ops++;
+	return;
+    }
+
+    other = (r->id + 1 + rand_r(&r->seed) % (replay_threads - 1)) 
+	% replay_threads;
+    box = &mailboxes[other];
+    pthread_mutex_lock(&box->lock);
+    while (box->count >= MAILBOX_MAX) {
+	pthread_mutex_unlock(&box->lock);
+	if (__atomic_load_n(&mailboxes[r->id].count, __ATOMIC_RELAXED))
+	    drain_mailbox(r);
+	else
+	    sched_yield();
+	pthread_mutex_lock(&box->lock);
+    }
+    if (box->count == box->max) {
+	box->max = box->max ? 2 * box->max : 64;
+	if ((box->blocks = realloc(box->blocks, box->max * sizeof(char *))) == NULL)
+	    unix_error("realloc in replay_free failed");
+    }
+    box->blocks[box->count] = p;
+    __atomic_store_n(&box->count, box->count + 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&box->lock);
+    r->remote++;
+}
+
+/*
+ * drain_mailbox - Free the blocks that other threads have handed to r
+ */
+static void drain_mailbox(replay_t *r)
+{
+    mailbox_t *box = &mailboxes[r->id];
+    char **blocks;
+    int i, count, max;
+
+    /* Swap in the spare array, so senders only wait for the swap */
+    pthread_mutex_lock(&box->lock);
+    blocks = box->blocks;
+    count = box->count;
+    max = box->max;
+    box->blocks = r->spare;
+    __atomic_store_n(&box->count, 0, __ATOMIC_RELAXED);
+    box->max = r->spare_max;
+    pthread_mutex_unlock(&box->lock);
+
+    for (i = 0; i < count; i++)
+	replay_free_fn(r->use_libc, blocks[i]);
+    r->ops += count;
+    r->spare = blocks;
+    r->spare_max = max;
+}
+
+/*
+ * replay_malloc_fn, replay_realloc_fn, replay_free_fn - Call libc or mm
+ *     malloc, taking mm_lock if mm.c is not thread-safe itself
+ */
+static void *replay_malloc_fn(int use_libc, size_t size)
+{
+    void *p;
+
+    if (use_libc)
+	return malloc(size);
+    if (mm_thread_safe)
+	return mm_malloc(size);
+    pthread_mutex_lock(&mm_lock);
+    p = mm_malloc(size);
+    pthread_mutex_unlock(&mm_lock);
+    return p;
+}
+
+static void *replay_realloc_fn(int use_libc, void *ptr, size_t size)
+{
+    void *p;
+
+    if (use_libc)
+	return realloc(ptr, size);
+    if (mm_thread_safe)
+	return mm_realloc(ptr, size);
+    pthread_mutex_lock(&mm_lock);
+    p = mm_realloc(ptr, size);
+    pthread_mutex_unlock(&mm_lock);
+    return p;
+}
+
+static void replay_free_fn(int use_libc, void *ptr)
+{
+    if (use_libc) {
+	free(ptr);
+	return;
+    }
+    if (mm_thread_safe) {
+	mm_free(ptr);
+	return;
+    }
+    pthread_mutex_lock(&mm_lock);
+    mm_free(ptr);
+    pthread_mutex_unlock(&mm_lock);
+}
+
 /*************************************
  * Some miscellaneous helper routines
  ************************************/
@@ -926,14 +1934,19 @@ static void printresults(int n, stats_t *stats)
     double util = 0;
 
     /* Print the individual results for each trace */
-    printf("%5s%7s %5s%8s%10s%6s\n", 
-	   "trace", " valid", "util", "ops", "secs", "Kops");
+    printf("%5s%7s %5s%9s%9s%8s%10s%6s\n", 
+	   "trace", " valid", "util", "peak KB", "final KB", "ops", "secs", "Kops");
     for (i=0; i < n; i++) {
 	if (stats[i].valid) {
-	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	    printf("%2d%10s%5.0f%%", 
 		   i,
 		   "yes",
-		   stats[i].util*100.0,
+		   stats[i].util*100.0);
+	    if (stats[i].peak) /* heap sizes are only known for mm.c */
+		printf("%9.0f%9.0f", stats[i].peak/1024.0, stats[i].final/1024.0);
+	    else
+		printf("%9s%9s", "-", "-");
+	    printf("%8.0f%10.6f%6.0f\n", 
 		   stats[i].ops,
 		   stats[i].secs,
 		   (stats[i].ops/1e3)/stats[i].secs);
@@ -942,29 +1955,33 @@ static void printresults(int n, stats_t *stats)
 	    util += stats[i].util;
 	}
 	else {
-	    printf("%2d%10s%6s%8s%10s%6s\n", 
+	    printf("%2d%10s%6s%9s%9s%8s%10s%6s\n", 
 		   i,
 		   "no",
 		   "-",
 		   "-",
 		   "-",
+		   "-",
+		   "-",
 		   "-");
 	}
     }
 
     /* Print the aggregate results for the set of traces */
     if (errors == 0) {
-	printf("%12s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	printf("%12s%5.0f%%%18s%8.0f%10.6f%6.0f\n", 
 	       "Total       ",
 	       (util/n)*100.0,
+	       "",
 	       ops, 
 	       secs,
 	       (ops/1e3)/secs);
     }
     else {
-	printf("%12s%6s%8s%10s%6s\n", 
+	printf("%12s%6s%18s%8s%10s%6s\n", 
 	       "Total       ",
 	       "-", 
+	       "",
 	       "-", 
 	       "-", 
 	       "-");
@@ -972,6 +1989,277 @@ static void printresults(int n, stats_t *stats)
 
 }
 
+/*
+ * The following routines build and print latency histograms (-H)
+ */
+
+/*
+ * counter_overhead - Estimate the cycles spent reading the counter
+ *     around a request, to be subtracted from each latency
+ */
+static double counter_overhead(void)
+{
+    double start, cycles, min = DBL_MAX;
+    int i;
+
+    for (i = 0; i < 1000; i++) {
+	start = read_counter();
+	cycles = read_counter() - start;
+	if (cycles < min)
+	    min = cycles;
+    }
+    return min;
+}
+
+/*
+ * hist_add - Count a request of the given latency, which was request
+ *     opnum of trace tracenum
+ */
+static void hist_add(hist_t *hist, double cycles, int tracenum, int opnum)
+{
+    int i;
+
+    hist->count++;
+    hist->sum += cycles;
+    if (cycles > hist->max)
+	hist->max = cycles;
+    hist->buckets[hist_index((unsigned long long)cycles)]++;
+
+    /* Keep the slowest requests, slowest first, each request once */
+    for (i = 0; i < hist->noutliers; i++)
+	if (hist->outliers[i].tracenum == tracenum && 
+	    hist->outliers[i].opnum == opnum)
+	    break;
+    if (i < hist->noutliers) {
+	if (cycles <= hist->outliers[i].cycles)
+	    return;
+	for (; i < hist->noutliers - 1; i++)
+	    hist->outliers[i] = hist->outliers[i+1];
+	hist->noutliers--;
+    }
+    if (hist->noutliers == HIST_OUTLIERS &&
+	cycles <= hist->outliers[HIST_OUTLIERS-1].cycles)
+	return;
+    if (hist->noutliers < HIST_OUTLIERS)
+	hist->noutliers++;
+    for (i = hist->noutliers - 1; 
+	 i > 0 && hist->outliers[i-1].cycles < cycles; i--)
+	hist->outliers[i] = hist->outliers[i-1];
+    hist->outliers[i].cycles = cycles;
+    hist->outliers[i].tracenum = tracenum;
+    hist->outliers[i].opnum = opnum;
+}
+
+/*
+ * hist_index - Return the bucket counting the given latency
+ */
+static int hist_index(unsigned long long cycles)
+{
+    int e;
+
+    if (cycles < (1 << HIST_SUBBITS))
+	return cycles;
+    e = 63 - __builtin_clzll(cycles);
+    return ((e - HIST_SUBBITS + 1) << HIST_SUBBITS) + 
+	((cycles >> (e - HIST_SUBBITS)) & ((1 << HIST_SUBBITS) - 1));
+}
+
+/*
+ * hist_lo - Return the smallest latency counted by bucket i
+ */
+static unsigned long long hist_lo(int i)
+{
+    int e;
+
+    if (i < (1 << HIST_SUBBITS))
+	return i;
+    e = (i >> HIST_SUBBITS) + HIST_SUBBITS - 1;
+    return (unsigned long long)((1 << HIST_SUBBITS) + 
+				(i & ((1 << HIST_SUBBITS) - 1))) 
+	<< (e - HIST_SUBBITS);
+}
+
+/*
+ * hist_percentile - Return an upper bound on the latency that fraction
+ *     p of the requests do not exceed
+ */
+static double hist_percentile(hist_t *hist, double p)
+{
+    double seen = 0, hi;
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS - 1; i++) {
+	seen += hist->buckets[i];
+	if (seen >= p * hist->count)
+	    break;
+    }
+    hi = hist_lo(i + 1) - 1;
+    return hi < hist->max ? hi : hist->max;
+}
+
+/*
+ * printhists - Print the latency percentiles of each type of request,
+ *     its histogram, and where in the traces its slowest requests are
+ */
+static void printhists(hist_t *hists, char **tracefiles)
+{
+    static char *names[] = {"malloc", "free", "realloc"};
+    hist_t *hist;
+    double peak, rows[64];
+    int type, i, lo, hi, width;
+
+    printf("\nLatency of mm malloc in cycles, over %d passes of each trace:\n",
+	   HIST_PASSES);
+    printf("%-8s%12s%10s%10s%10s%10s%12s\n", 
+	   "request", "count", "mean", "p50", "p99", "p99.9", "max");
+    for (type = ALLOC; type <= REALLOC; type++) {
+	hist = &hists[type];
+	if (hist->count == 0)
+	    continue;
+	printf("%-8s%12.0f%10.0f%10.0f%10.0f%10.0f%12.0f\n", names[type],
+	       hist->count, hist->sum / hist->count,
+	       hist_percentile(hist, 0.5), hist_percentile(hist, 0.99),
+	       hist_percentile(hist, 0.999), hist->max);
+    }
+
+    for (type = ALLOC; type <= REALLOC; type++) {
+	hist = &hists[type];
+	if (hist->count == 0)
+	    continue;
+
+	/* Print one row per power of two, from the first to the last 
+	   non-empty one. Row 0 holds the latencies below 2. */
+	memset(rows, 0, sizeof(rows));
+	for (i = 0; i < HIST_BUCKETS; i++) {
+	    lo = hist_lo(i) ? 63 - __builtin_clzll(hist_lo(i)) : 0;
+	    rows[lo] += hist->buckets[i];
+	}
+	for (lo = 0; rows[lo] == 0; lo++)
+	    ;
+	for (hi = 63; rows[hi] == 0; hi--)
+	    ;
+	for (peak = 0, i = lo; i <= hi; i++)
+	    if (rows[i] > peak)
+		peak = rows[i];
+	printf("\n%s:\n", names[type]);
+	for (i = lo; i <= hi; i++) {
+	    width = (int)(50 * rows[i] / peak + 0.5);
+	    printf("%10llu-%-10llu%10.0f %.*s\n", i ? 1ULL << i : 0, 
+		   (2ULL << i) - 1, rows[i], width,
+		   "**************************************************");
+	}
+	printf("slowest:");
+	for (i = 0; i < hist->noutliers; i++)
+	    printf(" %.0f (%s:%d)", hist->outliers[i].cycles,
+		   tracefiles[hist->outliers[i].tracenum], 
+		   LINENUM(hist->outliers[i].opnum));
+	printf("\n");
+    }
+}
+
+/*
+ * printstats - Print what mm_stats reports after the utilization replay
+ *     of a trace: the heap, free bytes by class and, if mm.c counts them,
+ *     the work its free lists did
+ */
+static void printstats(char *tracefile)
+{
+    mm_stats_t st;
+    int i;
+
+    mm_stats(&st);
+    printf("\nStatistics of mm malloc after %s:\n", tracefile);
+    printf("heap %.1f KB", st.heap / 1024.0);
+    if (st.counted)
+	printf(", peak %.1f KB", st.heap_peak / 1024.0);
+    printf(", mapped %.1f KB\n", st.mapped / 1024.0);
+    printf("in use %.1f KB, free %.1f KB, quick %.1f KB, slab spare %.1f KB\n",
+	   st.in_use / 1024.0, st.free / 1024.0, st.quick / 1024.0,
+	   st.slab_spare / 1024.0);
+    printf("free KB by class:");
+    for (i = 0; i < st.classes && i < MM_STATS_CLASSES; i++)
+	if (st.class_free[i])
+	    printf(" %d:%.1f", i, st.class_free[i] / 1024.0);
+    printf("\n");
+
+    if (!st.counted) {
+	printf("(build mm.c with -DMM_STATS for the counters)\n");
+	return;
+    }
+    printf("extends %lu, trims %lu, splits %lu, coalesces %lu\n",
+	   st.extends, st.trims, st.splits, st.coalesces);
+    printf("searches %lu, %.2f probes each, at most %lu\n", st.fits,
+	   st.fits ? (double)st.probes / st.fits : 0.0, st.max_probes);
+}
+
+/*
+ * printsnapshot - Print a line for a snapshot of the heap: its size, the
+ *     bytes in allocated (and slab), free and quick blocks, the number of
+ *     free blocks and the largest one, the external fragmentation (the
+ *     share of the free bytes outside the largest free block), and a map
+ *     that shows the kind of block covering the most of each cell
+ */
+static void printsnapshot(snapshot_t *snap, int opnum)
+{
+    static char marks[MM_BLOCK_KINDS] = {'#', '.', 'q', 's'};
+    char map[FRAG_CELLS + 1];
+    size_t free_bytes = snap->bytes[MM_BLOCK_FREE];
+    int c, kind, best;
+
+    for (c = 0; c < FRAG_CELLS; c++) {
+	for (best = -1, kind = 0; kind < MM_BLOCK_KINDS; kind++)
+	    if (snap->cells[c][kind] > 0 && 
+		(best < 0 || snap->cells[c][kind] > snap->cells[c][best]))
+		best = kind;
+	map[c] = best < 0 ? ' ' : marks[best];
+    }
+    map[FRAG_CELLS] = '\0';
+
+    printf("%10d%10.1f%10.1f%10.1f%10.1f%8d%10.1f%5.0f%%  %s\n", opnum,
+	   snap->heap / 1024.0, 
+	   (snap->bytes[MM_BLOCK_ALLOC] + snap->bytes[MM_BLOCK_SLAB]) / 1024.0,
+	   free_bytes / 1024.0, snap->bytes[MM_BLOCK_QUICK] / 1024.0,
+	   snap->blocks[MM_BLOCK_FREE], snap->largest / 1024.0,
+	   free_bytes ? 100.0 * (free_bytes - snap->largest) / free_bytes : 0.0,
+	   map);
+}
+
+/*
+ * printfrag - Print the free blocks of a snapshot by size, and the
+ *     length of each free list of mm.c
+ */
+static void printfrag(snapshot_t *snap, int opnum)
+{
+    int i, lo, hi, peak, width;
+
+    printf("At request %d, which has the most bytes allocated:\n", opnum);
+    if (snap->blocks[MM_BLOCK_FREE] == 0) {
+	printf("no free blocks\n");
+	return;
+    }
+
+    printf("%21s%8s\n", "free block bytes", "blocks");
+    for (lo = 0; snap->sizes[lo] == 0; lo++)
+	;
+    for (hi = FRAG_BUCKETS - 1; snap->sizes[hi] == 0; hi--)
+	;
+    for (peak = 0, i = lo; i <= hi; i++)
+	if (snap->sizes[i] > peak)
+	    peak = snap->sizes[i];
+    for (i = lo; i <= hi; i++) {
+	width = (int)(50.0 * snap->sizes[i] / peak + 0.5);
+	printf("%10llu-%-10llu%8d %.*s\n", 1ULL << i, (2ULL << i) - 1,
+	       snap->sizes[i], width,
+	       "**************************************************");
+    }
+
+    printf("%21s%8s\n", "free list class", "blocks");
+    for (i = 0; i < FRAG_CLASSES; i++)
+	if (snap->classes[i])
+	    printf("%6d (%6lu-%-6lu)%8d\n", i, (unsigned long)snap->class_lo[i],
+		   (unsigned long)snap->class_hi[i], snap->classes[i]);
+}
+
 /* 
  * app_error - Report an arbitrary application error
  */
@@ -1004,14 +2292,22 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvValHs] [-f <file>] [-t <dir>] [-T <n> [-x <frac>]]\n");
+    fprintf(stderr, "               [-F <n> [-S <prefix>]]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-F <n>     Print the fragmentation of mm malloc every <n> requests.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-H         Print latency histograms of mm malloc.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-s         Print the statistics of mm malloc after each trace.\n");
+    fprintf(stderr, "\t-S <pfx>   With -F, also draw the heap to <pfx><trace>.svg.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-T <n>     Replay the traces on <n> threads at once, dealt round-robin;\n");
+    fprintf(stderr, "\t           with fewer traces than threads, each thread replays a whole trace.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
+    fprintf(stderr, "\t-x <frac>  With -T, have another thread free <frac> of the blocks.\n");
 }
@@ -0,0 +1,244 @@
+/*
+ * memarena.c - The memlib.h interface on real memory, for running mm.c
+ *              inside real programs (see mm_preload.c). Unlike memlib.c,
+ *              it must not call malloc itself.
+ *
+ *              The heap is a reservation of MAX_HEAP bytes of address
+ *              space, made with mmap, whose pages the kernel only backs
+ *              once they are touched. Pages the heap shrinks away from
+ *              are given back with madvise. Each mapping is a real
+ *              anonymous mapping with one extra page in front that
+ *              records its size, so that no registry is needed.
+ */
+#define _GNU_SOURCE /* for mremap */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <errno.h>
+
+#include "memlib.h"
+#include "config.h"
+
+/* private variables */
+static char *mem_start_brk;  /* points to first byte of heap */
+static char *mem_brk;        /* points to last byte of heap */
+static char *mem_max_addr;   /* largest legal heap address */ 
+static size_t mem_peak;      /* largest footprint (heap and mappings) */
+static char *mem_zero;       /* heap bytes from here up read as zero */
+static size_t mem_mapped;    /* bytes in all live mappings */
+
+/* Size of the mapping that starts at start, kept in the page before it */
+#define MAP_SIZE(start) (*(size_t *)((char *)(start) - mem_pagesize()))
+
+static void note_peak(void);
+
+/* 
+ * mem_init - reserve the address space of the heap
+ */
+void mem_init(void)
+{
+    mem_start_brk = mmap(NULL, MAX_HEAP, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem_start_brk == MAP_FAILED) {
+	perror("mem_init: mmap");
+	exit(1);
+    }
+
+    mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
+    mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_zero = mem_start_brk;
+    mem_peak = 0;
+}
+
+/* 
+ * mem_deinit - release the heap. Mappings are not tracked, so they are
+ *    left to their owners.
+ */
+void mem_deinit(void)
+{
+    munmap(mem_start_brk, MAX_HEAP);
+}
+
+/*
+ * mem_reset_brk - reset the brk pointer to make an empty heap
+ */
+void mem_reset_brk()
+{
+    madvise(mem_start_brk, MAX_HEAP, MADV_DONTNEED);
+    mem_brk = mem_start_brk;
+    mem_zero = mem_start_brk;
+    mem_peak = 0;
+}
+
+/* 
+ * mem_sbrk - extend the heap by incr bytes and return the start address
+ *    of the new area. A negative incr shrinks the heap by -incr bytes,
+ *    giving back the whole pages above the new brk, and the old brk is
+ *    returned as with sbrk.
+ */
+void *mem_sbrk(int incr) 
+{
+    char *old_brk = mem_brk;
+    char *page;
+
+    if (incr < 0 && (mem_brk - mem_start_brk) < -(long)incr) {
+	errno = EINVAL;
+	return (void *)-1;
+    }
+    if ((mem_brk + incr) > mem_max_addr) {
+	errno = ENOMEM;
+	return (void *)-1;
+    }
+    mem_brk += incr;
+    if (incr < 0) {
+	/* The kernel clears the pages again, up to the end of the page
+	   that held the old brk */
+	page = (char *)(((unsigned long)mem_brk + mem_pagesize() - 1) & 
+			~(mem_pagesize() - 1));
+	if (page < old_brk) {
+	    madvise(page, old_brk - page, MADV_DONTNEED);
+	    mem_zero = page;
+	}
+    }
+    else if (mem_brk > mem_zero)
+	mem_zero = mem_brk;
+    note_peak();
+    return (void *)old_brk;
+}
+
+/*
+ * mem_map - map size bytes, rounded up to a whole number of pages, and
+ *    return the page-aligned start address, or (void *)-1 on failure
+ */
+void *mem_map(size_t size)
+{
+    char *start;
+
+    size = (size + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    start = mmap(NULL, size + mem_pagesize(), PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (start == MAP_FAILED)
+	return (void *)-1;
+
+    start += mem_pagesize();
+    MAP_SIZE(start) = size;
+    mem_mapped += size;
+    note_peak();
+    return (void *)start;
+}
+
+/*
+ * mem_unmap - release the mapping that starts at start. Returns 0.
+ */
+int mem_unmap(void *start)
+{
+    size_t size = MAP_SIZE(start);
+
+    mem_mapped -= size;
+    munmap((char *)start - mem_pagesize(), size + mem_pagesize());
+    return 0;
+}
+
+/*
+ * mem_remap - resize the mapping that starts at start to size bytes,
+ *    rounded up to a whole number of pages, moving it if it cannot be
+ *    resized in place; the contents are kept without being copied.
+ *    Returns the new start address, or (void *)-1 on failure, in which
+ *    case the old mapping is left as it was.
+ */
+void *mem_remap(void *start, size_t size)
+{
+    size_t oldsize = MAP_SIZE(start);
+    char *newstart;
+
+    size = (size + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    newstart = mremap((char *)start - mem_pagesize(), oldsize + mem_pagesize(),
+		      size + mem_pagesize(), MREMAP_MAYMOVE);
+    if (newstart == MAP_FAILED)
+	return (void *)-1;
+
+    newstart += mem_pagesize();
+    MAP_SIZE(newstart) = size;
+    mem_mapped += size - oldsize;
+    note_peak();
+    return (void *)newstart;
+}
+
+/*
+ * mem_is_mapped - return whether the bytes lo through hi lie in one
+ *    mapping. Only the driver asks, and it does not use this module.
+ */
+int mem_is_mapped(void *lo, void *hi)
+{
+    return 0;
+}
+
+/*
+ * mem_heap_lo - return address of the first heap byte
+ */
+void *mem_heap_lo()
+{
+    return (void *)mem_start_brk;
+}
+
+/* 
+ * mem_heap_hi - return address of last heap byte
+ */
+void *mem_heap_hi()
+{
+    return (void *)(mem_brk - 1);
+}
+
+/*
+ * mem_zero_lo - return the lowest address from which the memory that
+ *    mem_sbrk hands out reads as zero
+ */
+void *mem_zero_lo()
+{
+    return (void *)mem_zero;
+}
+
+/*
+ * mem_heapsize() - returns the heap size in bytes
+ */
+size_t mem_heapsize() 
+{
+    return (size_t)(mem_brk - mem_start_brk);
+}
+
+/*
+ * mem_mapsize() - returns the bytes in all mappings
+ */
+size_t mem_mapsize() 
+{
+    return mem_mapped;
+}
+
+/*
+ * mem_peak_heapsize() - returns the largest number of bytes the heap
+ *    and the mappings have held together since the heap was last reset
+ */
+size_t mem_peak_heapsize() 
+{
+    return mem_peak;
+}
+
+/*
+ * mem_pagesize() - returns the page size of the system
+ */
+size_t mem_pagesize()
+{
+    return (size_t)getpagesize();
+}
+
+/*
+ * note_peak - record the current footprint if it is the largest so far
+ */
+static void note_peak(void)
+{
+    size_t footprint = (size_t)(mem_brk - mem_start_brk) + mem_mapped;
+
+    if (footprint > mem_peak)
+	mem_peak = footprint;
+}
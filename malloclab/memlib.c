@@ -2,7 +2,13 @@
  * memlib.c - a module that simulates the memory system.  Needed because it 
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
+ *
+ *            Besides the sbrk heap, the model offers separate page-aligned
+ *            mappings, like mmap. They are real mappings, but are recorded
+ *            here so that the driver can check payloads against them and
+ *            count them in the memory footprint.
  */
+#define _GNU_SOURCE /* for mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -18,20 +24,38 @@
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static size_t mem_peak;      /* largest footprint (heap and mappings) */
+static char *mem_zero;       /* heap bytes from here up were never handed out */
+
+/* Live mappings */
+#define MAX_MAPS 256
+static struct {
+    char *start;             /* first byte of the mapping */
+    size_t size;             /* bytes mapped, a multiple of the page size */
+} mem_maps[MAX_MAPS];
+static int mem_nmaps;        /* number of live mappings */
+static size_t mem_mapped;    /* bytes in all live mappings */
+
+static int find_map(void *start);
+static void note_peak(void);
+static void unmap_all(void);
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
+    /* allocate the storage we will use to model the available VM,
+       zeroed as fresh memory from the kernel would be */
+    if ((mem_start_brk = (char *)calloc(1, MAX_HEAP)) == NULL) {
 	fprintf(stderr, "mem_init_vm: malloc error\n");
 	exit(1);
     }
 
     mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
     mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_zero = mem_start_brk;
+    mem_peak = 0;
 }
 
 /* 
@@ -39,35 +63,150 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
+    unmap_all();
     free(mem_start_brk);
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap,
+ *    and release every mapping. The old heap is not cleared, so it no
+ *    longer reads as zero.
  */
 void mem_reset_brk()
 {
+    unmap_all();
     mem_brk = mem_start_brk;
+    mem_peak = 0;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area.
+ *    A negative incr shrinks the heap by -incr bytes, and the old
+ *    brk is returned as with sbrk.
  */
 void *mem_sbrk(int incr) 
 {
     char *old_brk = mem_brk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    if (incr < 0 && (mem_brk - mem_start_brk) < -(long)incr) {
+	errno = EINVAL;
+	fprintf(stderr, "ERROR: mem_sbrk failed. Shrank below heap start...\n");
+	return (void *)-1;
+    }
+    if ((mem_brk + incr) > mem_max_addr) {
 	errno = ENOMEM;
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 	return (void *)-1;
     }
     mem_brk += incr;
+    if (mem_brk > mem_zero)
+	mem_zero = mem_brk;
+    note_peak();
     return (void *)old_brk;
 }
 
+/*
+ * mem_map - model of an anonymous mmap. Maps size bytes, rounded up
+ *    to a whole number of pages, and returns the page-aligned start
+ *    address, or (void *)-1 on failure. The total size of all mappings
+ *    is limited to MAX_HEAP.
+ */
+void *mem_map(size_t size)
+{
+    char *start;
+
+    size = (size + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    if (mem_nmaps == MAX_MAPS || mem_mapped + size > MAX_HEAP) {
+	errno = ENOMEM;
+	fprintf(stderr, "ERROR: mem_map failed. Ran out of memory...\n");
+	return (void *)-1;
+    }
+    start = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (start == MAP_FAILED) {
+	fprintf(stderr, "ERROR: mem_map failed. mmap error...\n");
+	return (void *)-1;
+    }
+
+    mem_maps[mem_nmaps].start = start;
+    mem_maps[mem_nmaps].size = size;
+    mem_nmaps++;
+    mem_mapped += size;
+    note_peak();
+    return (void *)start;
+}
+
+/*
+ * mem_unmap - release the mapping that starts at start. Returns 0, or
+ *    -1 if there is no such mapping.
+ */
+int mem_unmap(void *start)
+{
+    int i;
+
+    if ((i = find_map(start)) < 0) {
+	errno = EINVAL;
+	fprintf(stderr, "ERROR: mem_unmap failed. No mapping at %p...\n", start);
+	return -1;
+    }
+    munmap(mem_maps[i].start, mem_maps[i].size);
+    mem_mapped -= mem_maps[i].size;
+    mem_maps[i] = mem_maps[--mem_nmaps];
+    return 0;
+}
+
+/*
+ * mem_remap - model of mremap. Resizes the mapping that starts at start
+ *    to size bytes, rounded up to a whole number of pages, moving it if
+ *    it cannot be resized in place; the contents are kept without being
+ *    copied. Returns the new start address, or (void *)-1 on failure, in
+ *    which case the old mapping is left as it was.
+ */
+void *mem_remap(void *start, size_t size)
+{
+    char *newstart;
+    int i;
+
+    size = (size + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    if ((i = find_map(start)) < 0) {
+	errno = EINVAL;
+	fprintf(stderr, "ERROR: mem_remap failed. No mapping at %p...\n", start);
+	return (void *)-1;
+    }
+    if (mem_mapped - mem_maps[i].size + size > MAX_HEAP) {
+	errno = ENOMEM;
+	fprintf(stderr, "ERROR: mem_remap failed. Ran out of memory...\n");
+	return (void *)-1;
+    }
+    newstart = mremap(start, mem_maps[i].size, size, MREMAP_MAYMOVE);
+    if (newstart == MAP_FAILED) {
+	fprintf(stderr, "ERROR: mem_remap failed. mremap error...\n");
+	return (void *)-1;
+    }
+
+    mem_mapped += size - mem_maps[i].size;
+    mem_maps[i].start = newstart;
+    mem_maps[i].size = size;
+    note_peak();
+    return (void *)newstart;
+}
+
+/*
+ * mem_is_mapped - return whether the bytes lo through hi lie in one
+ *    mapping
+ */
+int mem_is_mapped(void *lo, void *hi)
+{
+    int i;
+
+    for (i = 0; i < mem_nmaps; i++)
+	if ((char *)lo >= mem_maps[i].start &&
+	    (char *)hi < mem_maps[i].start + mem_maps[i].size)
+	    return 1;
+    return 0;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -84,6 +223,15 @@ void *mem_heap_hi()
     return (void *)(mem_brk - 1);
 }
 
+/*
+ * mem_zero_lo - return the lowest address from which the memory that
+ *    mem_sbrk hands out reads as zero
+ */
+void *mem_zero_lo()
+{
+    return (void *)mem_zero;
+}
+
 /*
  * mem_heapsize() - returns the heap size in bytes
  */
@@ -92,6 +240,23 @@ size_t mem_heapsize()
     return (size_t)(mem_brk - mem_start_brk);
 }
 
+/*
+ * mem_mapsize() - returns the bytes in all mappings
+ */
+size_t mem_mapsize() 
+{
+    return mem_mapped;
+}
+
+/*
+ * mem_peak_heapsize() - returns the largest number of bytes the heap
+ *    and the mappings have held together since the heap was last reset
+ */
+size_t mem_peak_heapsize() 
+{
+    return mem_peak;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
@@ -99,3 +264,39 @@ size_t mem_pagesize()
 {
     return (size_t)getpagesize();
 }
+
+/*
+ * find_map - return the index of the mapping that starts at start, or -1
+ */
+static int find_map(void *start)
+{
+    int i;
+
+    for (i = 0; i < mem_nmaps; i++)
+	if (mem_maps[i].start == (char *)start)
+	    return i;
+    return -1;
+}
+
+/*
+ * note_peak - record the current footprint if it is the largest so far
+ */
+static void note_peak(void)
+{
+    size_t footprint = (size_t)(mem_brk - mem_start_brk) + mem_mapped;
+
+    if (footprint > mem_peak)
+	mem_peak = footprint;
+}
+
+/*
+ * unmap_all - release every mapping
+ */
+static void unmap_all(void)
+{
+    while (mem_nmaps > 0) {
+	mem_nmaps--;
+	munmap(mem_maps[mem_nmaps].start, mem_maps[mem_nmaps].size);
+    }
+    mem_mapped = 0;
+}
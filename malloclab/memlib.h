@@ -3,9 +3,16 @@
 void mem_init(void);               
 void mem_deinit(void);
 void *mem_sbrk(int incr);
+void *mem_map(size_t size);
+int mem_unmap(void *start);
+void *mem_remap(void *start, size_t size);
+int mem_is_mapped(void *lo, void *hi);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
+void *mem_zero_lo(void);
 size_t mem_heapsize(void);
+size_t mem_mapsize(void);
+size_t mem_peak_heapsize(void);
 size_t mem_pagesize(void);
 
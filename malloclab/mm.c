@@ -3,17 +3,94 @@
  * 
  * Simple, 32-bit and 64-bit clean allocator based on segregated free
  * lists, segregated-fits approach, and boundary tag coalescing, as described
- * in the CS:APP3e text. Blocks must be aligned to doubleword (8 byte) 
- * boundaries. Minimum block size is 32 bytes. 
+ * in the CS:APP3e text. Blocks must be aligned to ALIGNMENT bytes, a
+ * doubleword (8 bytes) for the driver; the preload build asks for 16, as
+ * programs expect of the C library's malloc. Minimum block size is 16 bytes. 
+ *
+ * Only free blocks carry a footer. Bit 1 of every header records whether
+ * the previous block is allocated, which is all coalesce needs to know
+ * about an allocated predecessor, so an allocated block's payload runs
+ * up to the next header.
+ *
+ * When a free block of at least TRIM_THRESHOLD bytes ends the heap, all but
+ * TRIM_PAD bytes of it are returned with a negative mem_sbrk, so the heap
+ * shrinks again after a burst. The gap between the two keeps a workload
+ * that hovers around the top of the heap from trimming and regrowing it.
+ *
+ * Requests of HUGE_THRESHOLD bytes or more get a mapping of their own from
+ * mem_map instead, so that they never fragment the heap. The mappings are
+ * kept in a registry; mm_free unmaps them, and mm_realloc resizes them
+ * with mem_remap, which does not copy the payload. A heap block that
+ * grows past the threshold stays in the heap until it has to move.
+ *
+ * mm_realloc resizes a heap block in place whenever it can: into a free
+ * block after it, by extending the heap if the block ends it, or into a
+ * free block before it, sliding the payload down. A growing block keeps
+ * what it takes beyond the request, up to its own size again, as room for
+ * the next growth; a shrinking block gives its tail back.
+ *
+ * mm_memalign and mm_aligned_alloc take a free block that holds the aligned
+ * block where it lies if one of the first few they look at does, and give
+ * back the space in front of and behind it. mm_calloc clears a large block
+ * only below mem_zero_lo, the mark above which memory from mem_sbrk has
+ * never been handed out and still reads as zero.
+ *
+ * Free blocks below TREE_SIZE bytes are kept in circular lists, one per
+ * size class: a class per doubleword below SMALL_SIZE bytes, then four
+ * per power of two. class() computes the class with one count of leading
+ * zeros, and a bitmap of non-empty lists lets find_fit go straight to the
+ * first non-empty class that is sure to fit. The list heads sit in the
+ * payload of the prologue block.
+ *
+ * Free list and tree links are stored as 4-byte offsets from the start of
+ * the heap (0 standing for NULL), which MAX_HEAP keeps well within range.
+ *
+ * Requests of at most SLAB_MAX bytes are instead served from slabs: page-sized,
+ * page-aligned blocks of the heap that are carved into objects of one
+ * size (1, 2 or 3 times ALIGNMENT bytes) without per-object headers. Each slab keeps its
+ * metadata and a free bitmap at the start of the page, and a bitmap of
+ * slab pages tells mm_free and mm_realloc which path a pointer belongs to.
+ *
+ * Free blocks of the top class are not kept in a list but in a treap
+ * ordered by (size, address), so that a best fit among them is found in
+ * logarithmic time. The priority of a node is a hash of its address, and
+ * its child links take the place of the list links in the payload.
+ *
+ * Freed heap blocks of at most QUICK_MAX bytes are not coalesced at once but
+ * pushed on quick lists, exact-size LIFO lists through which churn on small
+ * sizes reuses the same blocks without splitting and merging them each time.
+ * Blocks on a quick list stay marked allocated. All of them are freed and
+ * coalesced in one pass when a fit fails, or when a list exceeds QUICK_LIMIT
+ * blocks, and when a free leaves a block of QUICK_CONSOLIDATE bytes, which
+ * suggests the heap is emptying and should be free to shrink.
+ *
+ * Compiled with -DMM_THREAD_SAFE, the package may be called from several
+ * threads. The heap is then guarded by a single lock, and each thread keeps
+ * a cache of small blocks and slab objects in exact-size bins that serves
+ * most requests without taking it. Cached blocks remain marked allocated;
+ * an empty bin is refilled with a batch of blocks and an overfull one is
+ * flushed by half, each under one acquisition of the lock. The lock is
+ * held across fork, so that the thread-safe build can replace the C
+ * library's malloc (see mm_preload.c).
+ *
+ * Compiled with -DMM_STATS, the package counts heap extensions, trims,
+ * splits, merges and free list probes for mm_stats. The counters are only
+ * touched with the heap locked, and without the flag they compile away.
  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#ifdef MM_THREAD_SAFE
+#include <pthread.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
+#include "config.h"
 
 /*********************************************************
  * NOTE TO STUDENTS: Before you do anything else, please
@@ -31,11 +108,13 @@ team_t team = {
     /* Second member's email address (leave blank if none) */
     ""};
 
-/* single word (4) or double word (8) alignment */
+/* double word (8) or quad word (16) alignment */
+#ifndef ALIGNMENT
 #define ALIGNMENT 8
+#endif
 
 /* rounds up to the nearest multiple of ALIGNMENT */
-#define ALIGN(size) (((size) + (ALIGNMENT - 1)) & ~0x7)
+#define ALIGN(size) (((size) + (ALIGNMENT - 1)) & ~(ALIGNMENT - 1))
 
 #define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
 
@@ -44,11 +123,18 @@ team_t team = {
 #define WSIZE 4             /* Word and header/footer size (bytes) */
 #define DSIZE 8             /* Double word size (bytes) */
 #define CHUNKSIZE (1 << 12) /* Extend heap by this amount (bytes) */
+#define TRIM_THRESHOLD (128 * CHUNKSIZE) /* Trim a free block at the top this large */
+#define TRIM_PAD (32 * CHUNKSIZE)        /* Free space left at the top by a trim */
+#define SBRK_MAX (INT_MAX & ~(CHUNKSIZE - 1)) /* Largest step mem_sbrk takes */
 
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
 
-/* Pack a size and allocated bit into a word */
+#define MIN_BLOCK (2 * DSIZE) /* Header, two links and footer of a free block */
+
+/* Pack a size and allocated bits into a word */
 #define PACK(size, alloc) ((size) | (alloc))
+#define PREV_ALLOC 0x2      /* Header bit set if the previous block is allocated */
 
 /* Read and write a word at address p */
 #define GET(p) (*(unsigned int *)(p))
@@ -58,11 +144,21 @@ team_t team = {
 #define GETA(p) ((void *)(*(unsigned long *)(p)))
 #define PUTA(p, val) (*(unsigned long *)(p) = (unsigned long)(val))
 
+/* Read and write a link, stored as a word offset from heap_base, at address p.
+   PUTL evaluates val twice, so pass it a variable, not a call */
+#define GETL(p) ((void *)(GET(p) ? heap_base + GET(p) : NULL))
+#define PUTL(p, val) PUT(p, (val) ? (unsigned int)((char *)(val) - heap_base) : 0)
+
 /* Read the size and allocated fields from address p */
 #define GET_SIZE(p) (GET(p) & ~0x7)
 #define GET_ALLOC(p) (GET(p) & 0x1)
+#define GET_PREV_ALLOC(p) (GET(p) & PREV_ALLOC)
 
-/* Given block ptr, compute address of its header and footer */
+/* Set or clear the previous-allocated bit of the header at address p */
+#define SET_PREV_ALLOC(p) PUT(p, GET(p) | PREV_ALLOC)
+#define CLR_PREV_ALLOC(p) PUT(p, GET(p) & ~PREV_ALLOC)
+
+/* Given block ptr, compute address of its header and footer (free blocks only) */
 #define HDRP(ptr) ((char *)(ptr) - WSIZE)
 #define FTRP(ptr) ((char *)(ptr) + GET_SIZE(HDRP(ptr)) - DSIZE)
 
@@ -72,66 +168,292 @@ team_t team = {
 
 /* Given block ptr, compute address of its predecessor and successor fields */
 #define PREP(ptr) ((char *)(ptr))
-#define SUCP(ptr) ((char *)(ptr) + DSIZE)
+#define SUCP(ptr) ((char *)(ptr) + WSIZE)
 
 /* Given block ptr, compute address of predecessor and successor blocks */
-#define PRED_BLKP(ptr) (GETA(PREP(ptr)))
-#define SUCC_BLKP(ptr) (GETA(SUCP(ptr)))
+#define PRED_BLKP(ptr) (GETL(PREP(ptr)))
+#define SUCC_BLKP(ptr) (GETL(SUCP(ptr)))
+
+/* Given free block ptr in the tree, compute address of its child links */
+#define LEFTP(ptr) ((char *)(ptr))
+#define RIGHTP(ptr) ((char *)(ptr) + WSIZE)
+#define LEFT(ptr) (GETL(LEFTP(ptr)))
+#define RIGHT(ptr) (GETL(RIGHTP(ptr)))
+
+/* Treap priority of block ptr, a multiplicative hash of its address */
+#define PRIORITY(ptr) ((unsigned int)(((unsigned long)(ptr) >> 3) * 2654435761u))
+
+/* Size classes: one per doubleword below SMALL_SIZE, then four per power
+   of two. Free blocks of TREE_SIZE bytes and more are kept in the tree */
+#define SMALL_SIZE 128
+#define TREE_SIZE 4096
+#define SMALL_CLASSES (SMALL_SIZE / DSIZE - 2) /* 16 to 120 bytes */
+#define TREE_CLASS (SMALL_CLASSES + 4 * (12 - 7)) /* log2(TREE_SIZE) - log2(SMALL_SIZE) */
+#if TREE_CLASS > 64
+#error "class_map has one bit per list class"
+#endif
+
+/* The prologue block holds the head of each list, a pair of links */
+#define PROLOGUE_SIZE ALIGN(TREE_CLASS * DSIZE + DSIZE)
+
+/* Given the class x, compute address of the head of its list */
+#define CLASS_LIST(x) (heap_listp + ((x) * DSIZE))
 
-/* Given the class x, compute address of beginning of the list */
-#define CLASS_LIST(x) (heap_listp + ((x) * 3 * DSIZE))
+/* Adjust a request to a block size including overhead and alignment */
+#define ADJUST(size) ((size) + WSIZE <= MIN_BLOCK ? MIN_BLOCK : ALIGN((size) + WSIZE))
 
 /* Given block ptr, insert or delete it from the list */
 #define INSERT(ptr, heap_listp) \
-    PUTA(PREP(ptr), heap_listp); \
-    PUTA(SUCP(ptr), SUCC_BLKP(heap_listp)); \
-    PUTA(PREP(SUCC_BLKP(heap_listp)), ptr); \
-    PUTA(SUCP(heap_listp), ptr);
+    PUTL(PREP(ptr), heap_listp); \
+    PUTL(SUCP(ptr), SUCC_BLKP(heap_listp)); \
+    PUTL(PREP(SUCC_BLKP(heap_listp)), ptr); \
+    PUTL(SUCP(heap_listp), ptr);
 #define REMOVE(ptr) \
-    PUTA(PREP(SUCC_BLKP(ptr)), PRED_BLKP(ptr)); \
-    PUTA(SUCP(PRED_BLKP(ptr)), SUCC_BLKP(ptr));
+    PUTL(PREP(SUCC_BLKP(ptr)), PRED_BLKP(ptr)); \
+    PUTL(SUCP(PRED_BLKP(ptr)), SUCC_BLKP(ptr));
 /* $end mallocmacros */
 
+/* Slab constants and macros */
+#define SLAB_SIZE 4096  /* Bytes per slab, also its alignment */
+#define SLAB_MAX (3 * ALIGNMENT) /* Largest request served from slabs */
+#define SLAB_CLASSES (SLAB_MAX / ALIGNMENT)
+#define SPLIT_MIN ADJUST(SLAB_MAX + 1) /* Smallest remainder worth splitting off */
+#define SLAB_CLASS(size) (((size) - 1) / ALIGNMENT)
+#define SLAB_HDR ALIGN(sizeof(struct slab)) /* Offset of the first object */
+#define SLAB_PAGES (MAX_HEAP / SLAB_SIZE + 2)
+
+/* Given a pointer into a slab, compute the address of the slab */
+#define SLAB_OF(ptr) ((struct slab *)((unsigned long)(ptr) & ~(unsigned long)(SLAB_SIZE - 1)))
+
+/* Index of the heap page containing ptr in the slab page bitmap */
+#define PAGE_INDEX(ptr) (((unsigned long)(ptr) - \
+                          ((unsigned long)mem_heap_lo() & ~(unsigned long)(SLAB_SIZE - 1))) / SLAB_SIZE)
+
+/* Quick list constants and macros */
+#define QUICK_MAX 128  /* Largest block size kept on a quick list */
+#define QUICK_BINS ((QUICK_MAX - MIN_BLOCK) / DSIZE + 1)
+#define QUICK_BIN(size) (((size) - MIN_BLOCK) / DSIZE)
+#define QUICK_LIMIT 64 /* Blocks on a list before all lists are coalesced */
+#define QUICK_CONSOLIDATE (16 * CHUNKSIZE) /* Free block that coalesces them too */
+#define QUICK_MARK 0x4 /* Header bit of a quick block while mm_walk runs */
+
+/* Aligned blocks: the free fragment in front of an aligned block is at
+   most ALIGN_SLACK(align) bytes */
+#define ALIGN_SLACK(align) ((align) + MIN_BLOCK - ALIGNMENT)
+#define ALIGN_PROBES 16 /* Free blocks tried for an aligned fit as they lie */
+
+/* calloc clears blocks below this size outright; in larger ones it skips
+   what mem_sbrk has just handed out, which reads as zero */
+#define CALLOC_FRESH_MIN CHUNKSIZE
+
+/* Huge block constants and macros */
+#define HUGE_THRESHOLD (256 * CHUNKSIZE) /* Smallest request given its own mapping */
+#define HUGE_HDR ALIGN(sizeof(struct huge)) /* Offset of the payload in a mapping */
+#define HUGE_MAPSIZE(size) (((size) + HUGE_HDR + mem_pagesize() - 1) & ~(mem_pagesize() - 1))
+
+/* Given a huge block pointer, compute the address of its mapping */
+#define HUGE_OF(ptr) ((struct huge *)((char *)(ptr) - HUGE_HDR))
+
+/* Metadata at the start of each slab; objects follow at SLAB_HDR */
+struct slab
+{
+    struct slab *next, *prev;   /* Slabs of the class with free objects */
+    unsigned short objsize;     /* Object size (bytes) */
+    unsigned short nobjs;       /* Objects in the slab */
+    unsigned short nfree;       /* Free objects */
+    unsigned short cls;         /* Slab class */
+    unsigned int bitmap[16];    /* Free bitmap, bit set if object is free */
+};
+
+/* Metadata at the start of each mapping; the payload follows at HUGE_HDR */
+struct huge
+{
+    struct huge *next, *prev;   /* Registry of huge blocks */
+    size_t size;                /* Bytes mapped */
+};
+
 /* Global variables */
-static char *heap_listp = 0; /* Pointer to first block */
+static char *heap_listp = 0; /* Pointer to first block, the prologue */
+static char *heap_base = 0;  /* Origin of link offsets */
+static void *tree_root = 0;  /* Root of the tree of large free blocks */
+static uint64_t class_map;  /* Bit x set if the list of class x is not empty */
+static struct slab *slab_lists[SLAB_CLASSES]; /* Slabs with free objects */
+static int slab_empty[SLAB_CLASSES];          /* Empty slabs kept per class */
+static unsigned char slab_pages[(SLAB_PAGES + 7) / 8]; /* Heap pages that are slabs */
+static struct huge *huge_list = 0; /* Blocks that have their own mapping */
+static void *quick_lists[QUICK_BINS]; /* Freed small blocks, not yet coalesced */
+static int quick_count[QUICK_BINS];   /* Blocks on each quick list */
+static unsigned long quick_map;       /* Bit x set if quick list x is not empty */
+
+#ifdef MM_STATS
+static mm_stats_t counters;     /* The counters reported by mm_stats */
+static unsigned long fit_start; /* counters.probes when the search began */
+
+#define STAT(expr) (expr)
+#else
+#define STAT(expr)
+#endif
+
+#ifdef MM_THREAD_SAFE
+const int mm_thread_safe = 1;
+
+/* Per-thread cache constants */
+#define TCACHE_MAX 256                          /* Largest cached block size */
+#define TCACHE_HEAP_BINS ((TCACHE_MAX - MIN_BLOCK) / DSIZE + 1)
+#define TCACHE_BINS (TCACHE_HEAP_BINS + SLAB_CLASSES)
+#define TCACHE_BIN(size) (((size) - MIN_BLOCK) / DSIZE)
+#define TCACHE_SLAB_BIN(cls) (TCACHE_HEAP_BINS + (cls)) /* Slab objects */
+#define TCACHE_BATCH 16 /* Blocks taken from the heap per refill */
+#define TCACHE_LIMIT 64 /* Blocks a bin holds before half are flushed */
+
+/* Each thread's cache, bins are linked through the first payload word.
+   Heap blocks come first, one bin per size, then one bin per slab class */
+struct tcache
+{
+    void *bins[TCACHE_BINS];
+    int count[TCACHE_BINS];
+    unsigned gen; /* Heap generation the cached blocks belong to */
+};
+
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned heap_gen = 0; /* Bumped by mm_init, invalidates all caches */
+static __thread struct tcache tcache;
+static pthread_key_t tcache_key; /* Flushes a cache when its thread exits */
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+#define HEAP_LOCK() pthread_mutex_lock(&heap_lock)
+#define HEAP_UNLOCK() pthread_mutex_unlock(&heap_lock)
+#else
+const int mm_thread_safe = 0;
+
+#define HEAP_LOCK()
+#define HEAP_UNLOCK()
+#endif
 
 /* Function prototypes for internal helper routines */
+static int init_heap(void);
+static void *malloc_block(size_t asize);
+static void free_block(void *ptr);
+static void *realloc_block(void *ptr, size_t asize);
+static void shrink_block(void *ptr, size_t asize);
 static void *extend_heap(size_t words);
+static void trim_heap(void *ptr);
 static void place(void *ptr, size_t asize);
 static int class(size_t x);
+static void quick_free(void *ptr);
+static void quick_consolidate(void);
 
 static void *find_fit(size_t asize);
 static void *coalesce(void *ptr);
+static void insert_block(void *ptr);
+static void remove_block(void *ptr);
+
+static int tree_less(void *a, void *b);
+static void *tree_insert(void *root, void *ptr);
+static void *tree_remove(void *root, void *ptr);
+static void *tree_merge(void *a, void *b);
+static void *tree_fit(size_t asize);
+static void *alloc_aligned(size_t align, size_t asize);
+static void *aligned_fit(size_t align, size_t asize);
+static size_t aligned_lead(void *ptr, size_t align);
+
+static int is_slab(void *ptr);
+static void *slab_malloc(int cls);
+static void slab_free(void *ptr);
+static void *slab_realloc(void *ptr, size_t size);
+static struct slab *slab_create(int cls);
+static void slab_link(struct slab *slab);
+static void slab_unlink(struct slab *slab);
+
+static int is_huge(void *ptr);
+static void *huge_malloc(size_t size);
+static void huge_free(void *ptr);
+static void *huge_realloc(void *ptr, size_t size);
+
+static void walk_heap(mm_walker_t fn, void *arg);
+static void stats_block(void *arg, void *ptr, size_t size, int kind, int cls);
+#ifdef MM_STATS
+static void count_probe(void);
+#endif
 
 static void checkheap();
 static void checkblock(void *ptr);
 static void checklist(void *ptr);
+static void checkslab(struct slab *slab);
+static void checkhuge(struct huge *huge);
+static size_t checktree(void *root, void *lo, void *hi);
+
+#ifdef MM_THREAD_SAFE
+static void *tcache_malloc(int bin);
+static void tcache_free(void *ptr, int bin);
+static void *tcache_take(int bin);
+static void tcache_push(void *ptr, int bin);
+static void tcache_release(void *ptr, int bin);
+static void tcache_flush(struct tcache *tc, int bin, int keep);
+static void tcache_check(void);
+static void tcache_key_create(void);
+static void tcache_destroy(void *arg);
+static void atfork_register(void);
+static void atfork_lock(void);
+static void atfork_unlock(void);
+#endif
 
 /* 
  * mm_init - Initialize the memory manager 
  */
 int mm_init(void)
 {
+    int rc;
+
+#ifdef MM_THREAD_SAFE
+    pthread_once(&atfork_once, atfork_register);
+#endif
+    HEAP_LOCK();
+#ifdef MM_THREAD_SAFE
+    ++heap_gen;
+#endif
+    rc = init_heap();
+    HEAP_UNLOCK();
+    return rc;
+}
+
+/* 
+ * init_heap - Create the prologue block and the initial free block
+ */
+static int init_heap(void)
+{
+    /* Forget the slabs of the previous heap */
+    memset(slab_lists, 0, sizeof(slab_lists));
+    memset(slab_empty, 0, sizeof(slab_empty));
+    memset(slab_pages, 0, sizeof(slab_pages));
+
+    /* The mappings of the previous heap are gone as well */
+    huge_list = 0;
+    tree_root = 0;
+    memset(quick_lists, 0, sizeof(quick_lists));
+    memset(quick_count, 0, sizeof(quick_count));
+    quick_map = 0;
+    STAT(memset(&counters, 0, sizeof(counters)));
+
     /* Create the initial empty heap */
-    if ((heap_listp = mem_sbrk(40 * DSIZE)) == (void *)-1)
+    heap_base = mem_heap_lo();
+    if ((heap_listp = mem_sbrk(ALIGNMENT + PROLOGUE_SIZE)) == (void *)-1)
         return -1;
 
-    PUT(heap_listp, 0);                          /* Alignment padding */
-    heap_listp += DSIZE;                         /* Prologue (Head) */
+    PUT(heap_listp, 0);                                   /* Alignment padding */
+    heap_listp += ALIGNMENT;                              /* Prologue (Head) */
+    PUT(HDRP(heap_listp), PACK(PROLOGUE_SIZE, 1 | PREV_ALLOC)); /* Prologue header */
 
-    size_t i;
-    for (i = 0; i < 13; ++i)
+    int i;
+    for (i = 0; i < TREE_CLASS; ++i)
     {
-        PUT(HDRP(CLASS_LIST(i)), PACK((3 * DSIZE), 1)); /* Prologue header */
-        PUT(FTRP(CLASS_LIST(i)), PACK((3 * DSIZE), 1)); /* Prologue footer */
-        PUTA(PREP(CLASS_LIST(i)), CLASS_LIST(i - 1));   /* Prologue predecessor */
-        PUTA(SUCP(CLASS_LIST(i)), CLASS_LIST(i + 1));   /* Prologue successor */
+        PUTL(PREP(CLASS_LIST(i)), CLASS_LIST(i)); /* Empty list */
+        PUTL(SUCP(CLASS_LIST(i)), CLASS_LIST(i));
     }
+    class_map = 0;
 
-    PUTA(PREP(CLASS_LIST(0)), 0);
-    PUTA(SUCP(CLASS_LIST(12)), 0);
-
-    PUT(HDRP(NEXT_BLKP(CLASS_LIST(12))), PACK(0, 1));   /* Epilogue header */
+    PUT(HDRP(NEXT_BLKP(heap_listp)), PACK(0, 1 | PREV_ALLOC)); /* Epilogue header */
    
     /* Extend the empty heap with a free block of CHUNKSIZE bytes */
     if (extend_heap(CHUNKSIZE / WSIZE) == NULL)
@@ -144,34 +466,37 @@ int mm_init(void)
  */
 void *mm_malloc(size_t size)
 {
-    size_t asize;      /* Adjusted block size */
-    size_t extendsize; /* Amount to extend heap if no fit */
-    char *ptr;
+    size_t asize; /* Adjusted block size */
+    void *ptr;
 
     /* Ignore spurious requests */
     if (size == 0)
         return NULL;
 
-    /* Adjust block size to include overhead and alignment reqs. */
-    if (size <= (3 * DSIZE))
-        asize = 4 * DSIZE;
-    else
-        asize = DSIZE * ((size + (DSIZE) + (DSIZE - 1)) / DSIZE);
-
-    /* Search the free list for a fit */
-    if ((ptr = find_fit(asize)) != NULL)
+    if (size <= SLAB_MAX)
     {
-        REMOVE(ptr);
-        place(ptr, asize);
+#ifdef MM_THREAD_SAFE
+        return tcache_malloc(TCACHE_SLAB_BIN(SLAB_CLASS(size)));
+#else
+        return slab_malloc(SLAB_CLASS(size));
+#endif
+    }
+    if (size >= HUGE_THRESHOLD)
+    {
+        HEAP_LOCK();
+        ptr = huge_malloc(size);
+        HEAP_UNLOCK();
         return ptr;
     }
 
-    /* No fit found. Get more memory and place the block */
-    extendsize = MAX(asize, CHUNKSIZE);
-    if ((ptr = extend_heap(extendsize / WSIZE)) == NULL)
-        return NULL;
-    REMOVE(ptr);
-    place(ptr, asize);
+    asize = ADJUST(size);
+#ifdef MM_THREAD_SAFE
+    if (asize <= TCACHE_MAX)
+        return tcache_malloc(TCACHE_BIN(asize));
+#endif
+    HEAP_LOCK();
+    ptr = malloc_block(asize);
+    HEAP_UNLOCK();
     return ptr;
 }
 
@@ -183,11 +508,33 @@ void mm_free(void *ptr)
     if (ptr == 0)
         return;
 
-    size_t size = GET_SIZE(HDRP(ptr));
-
-    PUT(HDRP(ptr), PACK(size, 0));
-    PUT(FTRP(ptr), PACK(size, 0));
-    coalesce(ptr);
+    /* Slab objects have no header, so test for them first */
+    if (is_slab(ptr))
+    {
+#ifdef MM_THREAD_SAFE
+        tcache_free(ptr, TCACHE_SLAB_BIN(SLAB_OF(ptr)->cls));
+#else
+        slab_free(ptr);
+#endif
+        return;
+    }
+    if (is_huge(ptr))
+    {
+        HEAP_LOCK();
+        huge_free(ptr);
+        HEAP_UNLOCK();
+        return;
+    }
+#ifdef MM_THREAD_SAFE
+    if (GET_SIZE(HDRP(ptr)) <= TCACHE_MAX)
+    {
+        tcache_free(ptr, TCACHE_BIN(GET_SIZE(HDRP(ptr))));
+        return;
+    }
+#endif
+    HEAP_LOCK();
+    quick_free(ptr);
+    HEAP_UNLOCK();
 }
 
 /*
@@ -196,9 +543,6 @@ void mm_free(void *ptr)
  */
 void *mm_realloc(void *ptr, size_t size)
 {
-    size_t asize;      /* Adjusted block size */
-    size_t oldsize;    /* Original block size */
-    size_t next_size;  /* Next block size */
     void *newptr;
 
     /* If size == 0 then this is just free, and we return NULL. */
@@ -212,59 +556,367 @@ void *mm_realloc(void *ptr, size_t size)
     if (ptr == NULL)
         return mm_malloc(size);
 
-    /* Adjust block size to include overhead and alignment reqs. */
-    if (size <= (3 * DSIZE))
-        asize = 4 * DSIZE;
+    HEAP_LOCK();
+    if (is_huge(ptr))
+        newptr = huge_realloc(ptr, size);
+    else if (is_slab(ptr))
+        newptr = slab_realloc(ptr, size);
     else
-        asize = DSIZE * ((size + (DSIZE) + (DSIZE - 1)) / DSIZE);
+        newptr = realloc_block(ptr, ADJUST(size));
+    HEAP_UNLOCK();
+    return newptr;
+}
+
+/*
+ * mm_memalign - Allocate a block with at least size bytes of payload
+ *     aligned to alignment bytes, a power of two
+ */
+void *mm_memalign(size_t alignment, size_t size)
+{
+    void *ptr;
+
+    if (alignment <= ALIGNMENT)
+        return mm_malloc(size);
+    if (size == 0)
+        return NULL;
+
+    HEAP_LOCK();
+    ptr = alloc_aligned(alignment, ADJUST(size));
+    HEAP_UNLOCK();
+    return ptr;
+}
+
+/*
+ * mm_aligned_alloc - Allocate size bytes aligned to alignment bytes, as
+ *     C11 aligned_alloc; NULL unless alignment is a power of two
+ */
+void *mm_aligned_alloc(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)))
+        return NULL;
+    return mm_memalign(alignment, size);
+}
+
+/*
+ * mm_calloc - Allocate an array of nmemb elements of size bytes, cleared.
+ *     A heap block is cleared only below the mark under which the heap
+ *     has been handed out before, and where its own free block headers,
+ *     links and footer were written; a huge block is a new mapping, and
+ *     left as it is.
+ */
+void *mm_calloc(size_t nmemb, size_t size)
+{
+    size_t bytes, asize;
+    char *ptr, *zero;
+
+    if (size && nmemb > (size_t)-1 / size)
+        return NULL;
+    bytes = nmemb * size;
+    if (bytes >= HUGE_THRESHOLD)
+        return mm_malloc(bytes);
+    if (bytes < CALLOC_FRESH_MIN)
+    {
+        if ((ptr = mm_malloc(bytes)) != NULL)
+            memset(ptr, 0, bytes);
+        return ptr;
+    }
+
+    asize = ADJUST(bytes);
+    HEAP_LOCK();
+    zero = mem_zero_lo();
+    ptr = malloc_block(asize);
+    HEAP_UNLOCK();
+    if (ptr == NULL)
+        return NULL;
+
+    /* Clear what was handed out before, and at least the two links */
+    memset(ptr, 0, MIN(bytes, (size_t)MAX(zero - ptr, DSIZE)));
+
+    /* The footer of a free block may have ended it */
+    if (ptr + bytes > FTRP(ptr))
+        memset(FTRP(ptr), 0, ptr + bytes - FTRP(ptr));
+    return ptr;
+}
+
+/*
+ * mm_usable_size - Return the number of payload bytes of block ptr,
+ *     which may be more than were requested
+ */
+size_t mm_usable_size(void *ptr)
+{
+    if (ptr == NULL)
+        return 0;
+    if (is_slab(ptr))
+        return SLAB_OF(ptr)->objsize;
+    if (is_huge(ptr))
+        return HUGE_OF(ptr)->size - HUGE_HDR;
+    return GET_SIZE(HDRP(ptr)) - WSIZE;
+}
+
+/* 
+ * mm_check - Check the heap for correctness
+ */
+void mm_check()
+{
+    HEAP_LOCK();
+    checkheap();
+    HEAP_UNLOCK();
+}
+
+/*
+ * mm_walk - Call fn on every block after the prologue, in address order,
+ *     with the heap locked. Huge blocks are not in the heap and are left out.
+ */
+void mm_walk(mm_walker_t fn, void *arg)
+{
+    HEAP_LOCK();
+    walk_heap(fn, arg);
+    HEAP_UNLOCK();
+}
+
+/*
+ * mm_stats - Fill in *stats from a walk of the heap and the counters
+ */
+void mm_stats(mm_stats_t *stats)
+{
+    struct huge *huge;
+
+    HEAP_LOCK();
+#ifdef MM_STATS
+    *stats = counters;
+    stats->counted = 1;
+#else
+    memset(stats, 0, sizeof(*stats));
+#endif
+    stats->heap = mem_heapsize();
+    stats->classes = TREE_CLASS + 1;
+    for (huge = huge_list; huge != NULL; huge = huge->next)
+        stats->mapped += huge->size;
+    walk_heap(stats_block, stats);
+    HEAP_UNLOCK();
+}
+
+/* 
+ * The remaining routines are internal helper routines 
+ */
+
+/* 
+ * malloc_block - Allocate a block of asize bytes, with the heap locked
+ */
+static void *malloc_block(size_t asize)
+{
+    size_t extendsize; /* Amount to extend heap if no fit */
+    char *ptr;
+    int bin;
+
+    /* A block on the quick list of this size is ready to use */
+    if (asize <= QUICK_MAX && (ptr = quick_lists[bin = QUICK_BIN(asize)]) != NULL)
+    {
+        quick_lists[bin] = GETL(ptr);
+        if (--quick_count[bin] == 0)
+            quick_map &= ~(1UL << bin);
+        return ptr;
+    }
+
+    /* Search the free list for a fit, coalescing the quick lists if none */
+    if ((ptr = find_fit(asize)) == NULL && quick_map)
+    {
+        quick_consolidate();
+        ptr = find_fit(asize);
+    }
+    if (ptr != NULL)
+    {
+        remove_block(ptr);
+        place(ptr, asize);
+        return ptr;
+    }
+
+    /* No fit found. Get more memory and place the block */
+    extendsize = MAX(asize, CHUNKSIZE);
+    if ((ptr = extend_heap(extendsize / WSIZE)) == NULL)
+        return NULL;
+    remove_block(ptr);
+    place(ptr, asize);
+    return ptr;
+}
+
+/* 
+ * free_block - Free a block, with the heap locked
+ */
+static void free_block(void *ptr)
+{
+    size_t size = GET_SIZE(HDRP(ptr));
+
+    PUT(HDRP(ptr), PACK(size, GET_PREV_ALLOC(HDRP(ptr))));
+    PUT(FTRP(ptr), PACK(size, 0));
+    CLR_PREV_ALLOC(HDRP(NEXT_BLKP(ptr)));
+    ptr = coalesce(ptr);
+
+    /* Coalesce the quick lists as well, so that they cannot keep the heap
+       from shrinking, then trim the last block if it is free */
+    if (quick_map && GET_SIZE(HDRP(ptr)) >= QUICK_CONSOLIDATE)
+    {
+        quick_consolidate();
+        ptr = (char *)mem_heap_hi() + 1;
+        if (GET_PREV_ALLOC(HDRP(ptr)))
+            return;
+        ptr = PREV_BLKP(ptr);
+    }
+    trim_heap(ptr);
+}
+
+/*
+ * quick_free - Free a block, with the heap locked, deferring the coalescing
+ *     of a small one by pushing it on its quick list
+ */
+static void quick_free(void *ptr)
+{
+    size_t size = GET_SIZE(HDRP(ptr));
+    void *next;
+    int bin;
+
+    if (size > QUICK_MAX)
+    {
+        free_block(ptr);
+        return;
+    }
+
+    bin = QUICK_BIN(size);
+    next = quick_lists[bin];
+    PUTL(ptr, next);
+    quick_lists[bin] = ptr;
+    quick_map |= 1UL << bin;
+    if (++quick_count[bin] > QUICK_LIMIT)
+        quick_consolidate();
+}
+
+/*
+ * quick_consolidate - Free and coalesce every block on the quick lists.
+ *     Each list is emptied before its blocks are freed, as free_block may
+ *     call back here.
+ */
+static void quick_consolidate(void)
+{
+    void *ptr, *next;
+    int bin;
+
+    while (quick_map)
+    {
+        bin = __builtin_ctzl(quick_map);
+        quick_map &= quick_map - 1;
+        ptr = quick_lists[bin];
+        quick_lists[bin] = NULL;
+        quick_count[bin] = 0;
+        for (; ptr != NULL; ptr = next)
+        {
+            next = GETL(ptr);
+            free_block(ptr);
+        }
+    }
+}
+
+/*
+ * realloc_block - Resize block ptr to asize bytes, in place if possible,
+ *     with the heap locked. A block grows into a free block after it, into
+ *     new memory from mem_sbrk if it ends the heap, or else into a free
+ *     block before it, sliding the payload down with memmove. What it takes
+ *     beyond asize is kept as room for the next growth, unless that is more
+ *     than asize; a shrinking block gives its tail back. A block that has
+ *     to move and is huge by then moves into a mapping of its own.
+ */
+static void *realloc_block(void *ptr, size_t asize)
+{
+    size_t oldsize;    /* Original block size */
+    size_t avail;      /* Size of the block together with a free next block */
+    size_t prev_size;  /* Size of the previous block if free, else 0 */
+    void *next;        /* The block after ptr and the free block after it */
+    void *newptr;
 
     /* If size is smaller than current size, then shrink the old block. */
     oldsize = GET_SIZE(HDRP(ptr));
     if (asize <= oldsize)
     {
-        // place(ptr, asize);
+        shrink_block(ptr, asize);
         return ptr;
     }
 
-    /* If oldptr has enough space to extend, then extend the old block. */
-    next_size = GET_SIZE(HDRP(NEXT_BLKP(ptr)));
-    if (asize <= oldsize + next_size && !GET_ALLOC(HDRP(NEXT_BLKP(ptr))))
+    next = NEXT_BLKP(ptr);
+    avail = oldsize;
+    if (!GET_ALLOC(HDRP(next)))
     {
-        REMOVE(NEXT_BLKP(ptr));
-        oldsize += next_size;
-        PUT(HDRP(ptr), PACK(oldsize, 1));
-        PUT(FTRP(ptr), PACK(oldsize, 1));
+        avail += GET_SIZE(HDRP(next));
+        next = NEXT_BLKP(next);
+    }
+    prev_size = GET_PREV_ALLOC(HDRP(ptr)) ? 0 : GET_SIZE(HDRP(PREV_BLKP(ptr)));
 
-        // place(ptr, asize);
+    /* A block that ends the heap grows by what it lacks, a free block at
+       the least, rather than moving, unless it is to become huge */
+    if (avail < asize && GET_SIZE(HDRP(next)) == 0 && asize < HUGE_THRESHOLD &&
+        extend_heap(MAX(asize - avail, MIN_BLOCK) / WSIZE) != NULL)
+        avail = oldsize + GET_SIZE(HDRP(NEXT_BLKP(ptr)));
+
+    /* If oldptr has enough space to extend, then extend the old block. */
+    if (asize <= avail)
+    {
+        remove_block(NEXT_BLKP(ptr));
+        PUT(HDRP(ptr), PACK(avail, 1 | GET_PREV_ALLOC(HDRP(ptr))));
+        SET_PREV_ALLOC(HDRP(NEXT_BLKP(ptr)));
+        STAT(counters.coalesces++);
+        if (avail - asize > asize)
+            shrink_block(ptr, asize);
         return ptr;
     }
 
-    newptr = mm_malloc(size);
+    /* Merge with the free block before, moving the payload down to it */
+    if (asize <= avail + prev_size)
+    {
+        newptr = PREV_BLKP(ptr);
+        remove_block(newptr);
+        STAT(counters.coalesces++);
+        if (avail > oldsize)
+        {
+            remove_block(NEXT_BLKP(ptr));
+            STAT(counters.coalesces++);
+        }
+        memmove(newptr, ptr, oldsize - WSIZE);
+        PUT(HDRP(newptr), PACK(avail + prev_size, 1 | PREV_ALLOC));
+        SET_PREV_ALLOC(HDRP(NEXT_BLKP(newptr)));
+        if (avail + prev_size - asize > asize)
+            shrink_block(newptr, asize);
+        return newptr;
+    }
+
+    newptr = asize >= HUGE_THRESHOLD ? huge_malloc(asize) : malloc_block(asize);
 
     /* If realloc() fails the original block is left untouched  */
     if (!newptr)
         return 0;
 
     /* Copy the old data. */
-    memcpy(newptr, ptr, oldsize);
+    memcpy(newptr, ptr, oldsize - WSIZE);
 
     /* Free the old block. */
-    mm_free(ptr);
+    free_block(ptr);
 
     return newptr;
 }
 
-/* 
- * mm_check - Check the heap for correctness
+/*
+ * shrink_block - Cut allocated block ptr down to asize bytes, freeing
+ *     the tail if it could serve a heap request
  */
-void mm_check()
+static void shrink_block(void *ptr, size_t asize)
 {
-    checkheap();
-}
+    size_t csize = GET_SIZE(HDRP(ptr));
 
-/* 
- * The remaining routines are internal helper routines 
- */
+    if (csize - asize < SPLIT_MIN)
+        return;
+    PUT(HDRP(ptr), PACK(asize, 1 | GET_PREV_ALLOC(HDRP(ptr))));
+    ptr = NEXT_BLKP(ptr);
+    PUT(HDRP(ptr), PACK(csize - asize, 1 | PREV_ALLOC));
+    STAT(counters.splits++);
+    free_block(ptr);
+}
 
 /* 
  * extend_heap - Extend heap with free block and return its block pointer
@@ -274,60 +926,91 @@ static void *extend_heap(size_t words)
     char *ptr;
     size_t size;
 
-    /* Allocate an even number of words to maintain alignment */
-    size = (words % 2) ? (words + 1) * WSIZE : words * WSIZE;
-    if ((ptr = mem_sbrk(size)) == (void *)-1)
+    /* Allocate a multiple of ALIGNMENT bytes to maintain alignment */
+    size = ALIGN(words * WSIZE);
+    if (size > SBRK_MAX || (ptr = mem_sbrk((int)size)) == (void *)-1)
         return NULL;
+    STAT(counters.extends++);
+    STAT(counters.heap_peak = MAX(counters.heap_peak, mem_heapsize()));
 
     /* Initialize free block header/footer and the epilogue header */
-    PUT(HDRP(ptr), PACK(size, 0));         /* Free block header */
-    PUT(FTRP(ptr), PACK(size, 0));         /* Free block footer */
-    PUT(HDRP(NEXT_BLKP(ptr)), PACK(0, 1)); /* New epilogue header */
+    PUT(HDRP(ptr), PACK(size, GET_PREV_ALLOC(HDRP(ptr)))); /* Free block header */
+    PUT(FTRP(ptr), PACK(size, 0));                         /* Free block footer */
+    PUT(HDRP(NEXT_BLKP(ptr)), PACK(0, 1));                 /* New epilogue header */
 
     /* Coalesce if the previous block was free */
     return coalesce(ptr);
 }
 
+/*
+ * trim_heap - Give the end of free block ptr back to the memory system
+ *     if it is the last block and at least TRIM_THRESHOLD bytes. TRIM_PAD
+ *     bytes are kept, so that a burst of requests right after a trim does
+ *     not have to extend the heap again.
+ */
+static void trim_heap(void *ptr)
+{
+    size_t size = GET_SIZE(HDRP(ptr));
+    size_t release;
+
+    if (size < TRIM_THRESHOLD || GET_SIZE(HDRP(NEXT_BLKP(ptr))) != 0)
+        return;
+
+    /* Release whole chunks, leaving at least TRIM_PAD bytes */
+    release = (size - TRIM_PAD) & ~(size_t)(CHUNKSIZE - 1);
+    remove_block(ptr);
+    size -= release;
+    PUT(HDRP(ptr), PACK(size, GET_PREV_ALLOC(HDRP(ptr)))); /* Free block header */
+    PUT(FTRP(ptr), PACK(size, 0));                         /* Free block footer */
+    PUT(HDRP(NEXT_BLKP(ptr)), PACK(0, 1));                 /* New epilogue header */
+    insert_block(ptr);
+
+    /* mem_sbrk takes an int, so more than that goes back in steps */
+    for (; release > SBRK_MAX; release -= SBRK_MAX)
+        mem_sbrk(-SBRK_MAX);
+    mem_sbrk(-(int)release);
+    STAT(counters.trims++);
+}
+
 /* 
  * place - Place block of asize bytes at start of free block ptr 
- *         and split if remainder would be at least minimum block size
+ *         and split if the remainder could serve a heap request
  */
 static void place(void *ptr, size_t asize)
 {
     size_t csize = GET_SIZE(HDRP(ptr));
+    size_t prev_alloc = GET_PREV_ALLOC(HDRP(ptr));
 
-    if ((csize - asize) >= (4 * DSIZE))
+    if ((csize - asize) >= SPLIT_MIN)
     {
-        PUT(HDRP(ptr), PACK(asize, 1));
-        PUT(FTRP(ptr), PACK(asize, 1));
+        PUT(HDRP(ptr), PACK(asize, 1 | prev_alloc));
         ptr = NEXT_BLKP(ptr);
-        PUT(HDRP(ptr), PACK(csize - asize, 0));
+        PUT(HDRP(ptr), PACK(csize - asize, PREV_ALLOC));
         PUT(FTRP(ptr), PACK(csize - asize, 0));
-        INSERT(ptr, CLASS_LIST(class(GET_SIZE(HDRP(ptr)))));
+        insert_block(ptr);
+        STAT(counters.splits++);
     }
     else
     {
-        PUT(HDRP(ptr), PACK(csize, 1));
-        PUT(FTRP(ptr), PACK(csize, 1));
+        PUT(HDRP(ptr), PACK(csize, 1 | prev_alloc));
+        SET_PREV_ALLOC(HDRP(NEXT_BLKP(ptr)));
     }
 }
 
 /* 
- * class - Determine the class which block ptr belongs to
+ * class - Determine the class of a free block of x bytes
  */
 static int class(size_t x)
 {
-    size_t bits = 0;
-    x -= 1;
+    int log, c;
 
-    while (x)
-    {
-        x >>= 1;
-        ++bits;
-    }
+    if (x < SMALL_SIZE)
+        return x / DSIZE - 2;
 
-    bits -= 2;
-    return bits > 11 ? 11 : bits;
+    /* Four classes per power of two, picked by the two bits after the top one */
+    log = 8 * sizeof(unsigned long) - 1 - __builtin_clzl(x);
+    c = SMALL_CLASSES + 4 * (log - 7) + ((x >> (log - 2)) & 3);
+    return c < TREE_CLASS ? c : TREE_CLASS;
 }
 
 /* 
@@ -335,96 +1018,907 @@ static int class(size_t x)
  */
 static void *find_fit(size_t asize)
 {
+    int x = class(asize);
+    uint64_t map;
     void *ptr;
-    for (ptr = CLASS_LIST(class(asize)); SUCC_BLKP(ptr); ptr = SUCC_BLKP(ptr))
+
+    STAT(counters.fits++);
+    STAT(fit_start = counters.probes);
+    if (x < TREE_CLASS)
     {
-        if (asize <= GET_SIZE(HDRP(ptr)))
-            return ptr;
+        /* Blocks of the class of asize may still be too small */
+        for (ptr = SUCC_BLKP(CLASS_LIST(x)); ptr != CLASS_LIST(x); ptr = SUCC_BLKP(ptr))
+        {
+            STAT(count_probe());
+            if (asize <= GET_SIZE(HDRP(ptr)))
+                return ptr;
+        }
+
+        /* Every block of a higher class fits */
+        if ((map = class_map & (~(uint64_t)0 << (x + 1))) != 0)
+            return SUCC_BLKP(CLASS_LIST(__builtin_ctzll(map)));
     }
-    return NULL; /* No fit */
+    return tree_fit(asize); /* Best fit among the large blocks */
 }
 
 /*
- * coalesce - Boundary tag coalescing. Return ptr to coalesced block
+ * coalesce - Boundary tag coalescing. Return ptr to coalesced block.
+ *     The next block must already have its previous-allocated bit clear.
+ *     A free block's predecessor is always allocated once coalesced.
  */
 static void *coalesce(void *ptr)
 {
-    size_t prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(ptr)));
+    size_t prev_alloc = GET_PREV_ALLOC(HDRP(ptr));
     size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(ptr)));
     size_t size = GET_SIZE(HDRP(ptr));
 
     if (prev_alloc && !next_alloc)
     {
-        REMOVE(NEXT_BLKP(ptr));
+        remove_block(NEXT_BLKP(ptr));
         size += GET_SIZE(HDRP(NEXT_BLKP(ptr)));
-        PUT(HDRP(ptr), PACK(size, 0));
+        PUT(HDRP(ptr), PACK(size, PREV_ALLOC));
         PUT(FTRP(ptr), PACK(size, 0));
+        STAT(counters.coalesces++);
     }
     else if (!prev_alloc && next_alloc)
     {
-        REMOVE(PREV_BLKP(ptr));
+        remove_block(PREV_BLKP(ptr));
         size += GET_SIZE(HDRP(PREV_BLKP(ptr)));
         PUT(FTRP(ptr), PACK(size, 0));
-        PUT(HDRP(PREV_BLKP(ptr)), PACK(size, 0));
+        PUT(HDRP(PREV_BLKP(ptr)), PACK(size, PREV_ALLOC));
         ptr = PREV_BLKP(ptr);
+        STAT(counters.coalesces++);
     }
     else if (!prev_alloc && !next_alloc)
     {
-        REMOVE(PREV_BLKP(ptr));
-        REMOVE(NEXT_BLKP(ptr));
+        remove_block(PREV_BLKP(ptr));
+        remove_block(NEXT_BLKP(ptr));
         size += GET_SIZE(HDRP(PREV_BLKP(ptr))) +
                 GET_SIZE(FTRP(NEXT_BLKP(ptr)));
-        PUT(HDRP(PREV_BLKP(ptr)), PACK(size, 0));
+        PUT(HDRP(PREV_BLKP(ptr)), PACK(size, PREV_ALLOC));
         PUT(FTRP(NEXT_BLKP(ptr)), PACK(size, 0));
         ptr = PREV_BLKP(ptr);
+        STAT(counters.coalesces += 2);
     }
 
-    INSERT(ptr, CLASS_LIST(class(GET_SIZE(HDRP(ptr)))));
+    insert_block(ptr);
     return ptr;
 }
 
-/* 
- * checkheap - Minimal check of the heap for consistency 
+/*
+ * insert_block - Insert free block ptr into its list or the tree
  */
-void checkheap()
+static void insert_block(void *ptr)
 {
-    /* Check implicit free lists */
-    size_t i;
-    for (i = 0; i < 12; ++i)
+    int x = class(GET_SIZE(HDRP(ptr)));
+
+    if (x >= TREE_CLASS)
+        tree_root = tree_insert(tree_root, ptr);
+    else
     {
-        if ((GET_SIZE(HDRP(CLASS_LIST(i))) != (3 * DSIZE)) || !GET_ALLOC(HDRP(CLASS_LIST(i))))
-            printf("Bad prologue header %d\n", i);
-        checkblock(CLASS_LIST(i));
+        INSERT(ptr, CLASS_LIST(x));
+        class_map |= (uint64_t)1 << x;
     }
+}
 
-    char *ptr;
-    for (ptr = heap_listp; GET_SIZE(HDRP(ptr)) > 0; ptr = NEXT_BLKP(ptr))
-        checkblock(ptr);
-
-    if ((GET_SIZE(HDRP(ptr)) != 0) || !(GET_ALLOC(HDRP(ptr))))
-        printf("Bad epilogue header\n");
+/*
+ * remove_block - Remove free block ptr from its list or the tree
+ */
+static void remove_block(void *ptr)
+{
+    int x = class(GET_SIZE(HDRP(ptr)));
 
-    /* Check explicit free lists */
-    for (ptr = SUCC_BLKP(heap_listp); SUCC_BLKP(ptr); ptr = SUCC_BLKP(ptr))
-        checklist(ptr);
+    if (x >= TREE_CLASS)
+        tree_root = tree_remove(tree_root, ptr);
+    else
+    {
+        REMOVE(ptr);
+        if (SUCC_BLKP(CLASS_LIST(x)) == CLASS_LIST(x))
+            class_map &= ~((uint64_t)1 << x);
+    }
+}
 
-    if ((GET_SIZE(HDRP(ptr)) != (3 * DSIZE)) || !GET_ALLOC(HDRP(ptr)))
-        printf("Bad tail header\n");
-    checklist(ptr);
+/*
+ * tree_less - Order blocks by size, then by address
+ */
+static int tree_less(void *a, void *b)
+{
+    size_t asize = GET_SIZE(HDRP(a)), bsize = GET_SIZE(HDRP(b));
+    return asize < bsize || (asize == bsize && (char *)a < (char *)b);
 }
 
-static void checkblock(void *ptr)
+/*
+ * tree_insert - Insert block ptr into the subtree at root and return
+ *     the new root of the subtree
+ */
+static void *tree_insert(void *root, void *ptr)
 {
-    if ((size_t)ptr % 8)
-        printf("Error: %p is not doubleword aligned\n", ptr);
-    if (GET(HDRP(ptr)) != GET(FTRP(ptr)))
-        printf("Error: header does not match footer\n");
+    void *child;
+
+    if (root == NULL)
+    {
+        PUTL(LEFTP(ptr), 0);
+        PUTL(RIGHTP(ptr), 0);
+        return ptr;
+    }
+
+    /* Insert below, then rotate the child up if it has higher priority */
+    if (tree_less(ptr, root))
+    {
+        child = tree_insert(LEFT(root), ptr);
+        PUTL(LEFTP(root), child);
+        if (PRIORITY(child) > PRIORITY(root))
+        {
+            PUTL(LEFTP(root), RIGHT(child));
+            PUTL(RIGHTP(child), root);
+            return child;
+        }
+    }
+    else
+    {
+        child = tree_insert(RIGHT(root), ptr);
+        PUTL(RIGHTP(root), child);
+        if (PRIORITY(child) > PRIORITY(root))
+        {
+            PUTL(RIGHTP(root), LEFT(child));
+            PUTL(LEFTP(child), root);
+            return child;
+        }
+    }
+    return root;
 }
 
-static void checklist(void *ptr)
+/*
+ * tree_remove - Remove block ptr from the subtree at root and return the
+ *     new root of the subtree
+ */
+static void *tree_remove(void *root, void *ptr)
 {
-    if (SUCC_BLKP(PRED_BLKP(ptr)) != ptr)
-        printf("Error: consecutive pointers are not consistent");
-    if (GET_ALLOC(ptr))
-        printf("Error: %p in free list is allocated\n", ptr);
+    void *child;
+
+    if (root == ptr)
+        return tree_merge(LEFT(root), RIGHT(root));
+    if (tree_less(ptr, root))
+    {
+        child = tree_remove(LEFT(root), ptr);
+        PUTL(LEFTP(root), child);
+    }
+    else
+    {
+        child = tree_remove(RIGHT(root), ptr);
+        PUTL(RIGHTP(root), child);
+    }
+    return root;
+}
+
+/*
+ * tree_merge - Join subtrees a and b, where every block in a orders
+ *     before every block in b, and return the root of the result
+ */
+static void *tree_merge(void *a, void *b)
+{
+    void *child;
+
+    if (a == NULL)
+        return b;
+    if (b == NULL)
+        return a;
+    if (PRIORITY(a) > PRIORITY(b))
+    {
+        child = tree_merge(RIGHT(a), b);
+        PUTL(RIGHTP(a), child);
+        return a;
+    }
+    child = tree_merge(a, LEFT(b));
+    PUTL(LEFTP(b), child);
+    return b;
+}
+
+/*
+ * tree_fit - Find the smallest block in the tree of at least asize bytes
+ */
+static void *tree_fit(size_t asize)
+{
+    void *ptr = tree_root, *best = NULL;
+
+    while (ptr)
+    {
+        STAT(count_probe());
+        if (asize <= GET_SIZE(HDRP(ptr)))
+        {
+            best = ptr;
+            ptr = LEFT(ptr);
+        }
+        else
+            ptr = RIGHT(ptr);
+    }
+    return best;
+}
+
+/*
+ * alloc_aligned - Allocate a block of asize bytes whose payload is aligned
+ *     to align bytes. A free block that holds one where it lies is taken if
+ *     there is any. Otherwise the heap grows by what the aligned block
+ *     needs beyond a free block that ends it. The space in front of and
+ *     behind the aligned block is given back to the free lists.
+ */
+static void *alloc_aligned(size_t align, size_t asize)
+{
+    char *ptr, *aligned;
+    size_t csize, lead, need;
+
+    if ((ptr = aligned_fit(align, asize)) == NULL && quick_map)
+    {
+        quick_consolidate();
+        ptr = aligned_fit(align, asize);
+    }
+    if (ptr == NULL)
+    {
+        /* The aligned block will start in the free block that ends the
+           heap, if there is one, or else at the current end */
+        ptr = (char *)mem_heap_hi() + 1;
+        need = asize;
+        if (!GET_PREV_ALLOC(HDRP(ptr)))
+        {
+            ptr = PREV_BLKP(ptr);
+            need -= MIN(need, GET_SIZE(HDRP(ptr)));
+        }
+        need += aligned_lead(ptr, align);
+        if ((ptr = extend_heap(MAX(need, CHUNKSIZE) / WSIZE)) == NULL)
+            return NULL;
+    }
+    remove_block(ptr);
+    PUT(HDRP(ptr), PACK(GET_SIZE(HDRP(ptr)), 1 | PREV_ALLOC));
+    SET_PREV_ALLOC(HDRP(NEXT_BLKP(ptr)));
+    csize = GET_SIZE(HDRP(ptr));
+
+    /* The leading fragment must be able to hold a free block */
+    aligned = (char *)ptr + aligned_lead(ptr, align);
+    if ((lead = aligned - ptr) > 0)
+    {
+        PUT(HDRP(ptr), PACK(lead, 1 | GET_PREV_ALLOC(HDRP(ptr))));
+        PUT(HDRP(aligned), PACK(csize - lead, 1 | PREV_ALLOC));
+        STAT(counters.splits++);
+        free_block(ptr);
+    }
+
+    /* Give back the trailing fragment */
+    shrink_block(aligned, asize);
+    return aligned;
+}
+
+/*
+ * aligned_fit - Find a free block that holds a block of asize bytes with
+ *     its payload aligned to align bytes. The first ALIGN_PROBES blocks of
+ *     the lists from the class of asize up, and the best fit in the tree,
+ *     are tried as they lie; failing that, any fit with room for the
+ *     largest leading fragment will do.
+ */
+static void *aligned_fit(size_t align, size_t asize)
+{
+    uint64_t map;
+    void *ptr;
+    int x, probes = ALIGN_PROBES;
+
+    for (map = class_map & (~(uint64_t)0 << class(asize)); map != 0 && probes > 0; map &= map - 1)
+    {
+        x = __builtin_ctzll(map);
+        for (ptr = SUCC_BLKP(CLASS_LIST(x)); ptr != CLASS_LIST(x) && probes-- > 0; ptr = SUCC_BLKP(ptr))
+        {
+            if (aligned_lead(ptr, align) + asize <= GET_SIZE(HDRP(ptr)))
+                return ptr;
+        }
+    }
+    if ((ptr = tree_fit(asize)) != NULL &&
+        aligned_lead(ptr, align) + asize <= GET_SIZE(HDRP(ptr)))
+        return ptr;
+    return find_fit(asize + ALIGN_SLACK(align));
+}
+
+/*
+ * aligned_lead - Return the bytes between ptr and the first payload aligned
+ *     to align bytes that leaves room for a free block in front of it
+ */
+static size_t aligned_lead(void *ptr, size_t align)
+{
+    size_t lead = -(unsigned long)ptr & (align - 1);
+
+    return lead == 0 || lead >= MIN_BLOCK ? lead : lead + align;
+}
+
+/*
+ * walk_heap - Call fn on every block after the prologue, with the heap
+ *     locked. Blocks on the quick lists are marked first, as they look
+ *     allocated.
+ */
+static void walk_heap(mm_walker_t fn, void *arg)
+{
+    char *ptr;
+    int bin, kind;
+
+    /* Blocks on the quick lists look allocated, so mark them for the walk */
+    for (bin = 0; bin < QUICK_BINS; ++bin)
+        for (ptr = quick_lists[bin]; ptr != NULL; ptr = GETL(ptr))
+            PUT(HDRP(ptr), GET(HDRP(ptr)) | QUICK_MARK);
+
+    for (ptr = NEXT_BLKP(heap_listp); GET_SIZE(HDRP(ptr)) > 0; ptr = NEXT_BLKP(ptr))
+    {
+        if (!GET_ALLOC(HDRP(ptr)))
+        {
+            fn(arg, ptr, GET_SIZE(HDRP(ptr)), MM_BLOCK_FREE, class(GET_SIZE(HDRP(ptr))));
+            continue;
+        }
+        if (GET(HDRP(ptr)) & QUICK_MARK)
+        {
+            PUT(HDRP(ptr), GET(HDRP(ptr)) & ~QUICK_MARK);
+            kind = MM_BLOCK_QUICK;
+        }
+        else
+            kind = is_slab(ptr) ? MM_BLOCK_SLAB : MM_BLOCK_ALLOC;
+        fn(arg, ptr, GET_SIZE(HDRP(ptr)), kind, -1);
+    }
+}
+
+/*
+ * stats_block - Add a block reported by walk_heap to the mm_stats_t at arg.
+ *     A slab counts its allocated objects as in use, the rest as spare.
+ */
+static void stats_block(void *arg, void *ptr, size_t size, int kind, int cls)
+{
+    mm_stats_t *stats = (mm_stats_t *)arg;
+    struct slab *slab;
+    size_t used;
+
+    switch (kind)
+    {
+    case MM_BLOCK_FREE:
+        stats->free += size;
+        stats->class_free[cls] += size;
+        break;
+    case MM_BLOCK_QUICK:
+        stats->quick += size;
+        break;
+    case MM_BLOCK_SLAB:
+        slab = SLAB_OF(ptr);
+        used = (size_t)slab->objsize * (slab->nobjs - slab->nfree);
+        stats->in_use += used;
+        stats->slab_spare += size - used;
+        break;
+    default:
+        stats->in_use += size;
+    }
+}
+
+#ifdef MM_STATS
+/*
+ * count_probe - Count a free block looked at by the search begun when
+ *     counters.probes was fit_start
+ */
+static void count_probe(void)
+{
+    if (++counters.probes - fit_start > counters.max_probes)
+        counters.max_probes = counters.probes - fit_start;
+}
+#endif
+
+/*
+ * is_slab - Return whether ptr points into a slab
+ */
+static int is_slab(void *ptr)
+{
+    unsigned long page;
+
+    if ((char *)ptr < (char *)mem_heap_lo() || (char *)ptr > (char *)mem_heap_hi())
+        return 0;
+    page = PAGE_INDEX(ptr);
+    return (slab_pages[page / 8] >> (page % 8)) & 1;
+}
+
+/*
+ * slab_malloc - Allocate an object from a slab of class cls
+ */
+static void *slab_malloc(int cls)
+{
+    struct slab *slab = slab_lists[cls];
+    int i, bit;
+
+    if (slab == NULL && (slab = slab_create(cls)) == NULL)
+        return NULL;
+
+    for (i = 0; !slab->bitmap[i]; ++i)
+        ;
+    bit = __builtin_ctz(slab->bitmap[i]);
+    slab->bitmap[i] &= ~(1u << bit);
+    if (slab->nfree-- == slab->nobjs)
+        --slab_empty[cls];
+    if (slab->nfree == 0)
+        slab_unlink(slab);
+    return (char *)slab + SLAB_HDR + (i * 32 + bit) * slab->objsize;
+}
+
+/*
+ * slab_free - Free a slab object. A slab that becomes empty is returned
+ *     to the heap unless it is the only empty slab of its class.
+ */
+static void slab_free(void *ptr)
+{
+    struct slab *slab = SLAB_OF(ptr);
+    int i = ((char *)ptr - (char *)slab - SLAB_HDR) / slab->objsize;
+    unsigned long page;
+
+    slab->bitmap[i / 32] |= 1u << (i % 32);
+    if (++slab->nfree == 1)
+        slab_link(slab);
+    if (slab->nfree < slab->nobjs || slab_empty[slab->cls]++ == 0)
+        return;
+
+    --slab_empty[slab->cls];
+    slab_unlink(slab);
+    page = PAGE_INDEX(slab);
+    slab_pages[page / 8] &= ~(1 << (page % 8));
+    free_block(slab);
+}
+
+/*
+ * slab_realloc - Resize a slab object, moving it if it does not fit
+ */
+static void *slab_realloc(void *ptr, size_t size)
+{
+    struct slab *slab = SLAB_OF(ptr);
+    void *newptr;
+
+    if (size <= slab->objsize)
+        return ptr;
+
+    if (size <= SLAB_MAX)
+        newptr = slab_malloc(SLAB_CLASS(size));
+    else if (size >= HUGE_THRESHOLD)
+        newptr = huge_malloc(size);
+    else
+        newptr = malloc_block(ADJUST(size));
+    if (!newptr)
+        return 0;
+    memcpy(newptr, ptr, slab->objsize);
+    slab_free(ptr);
+    return newptr;
+}
+
+/*
+ * slab_create - Carve a new empty slab of class cls from the heap
+ */
+static struct slab *slab_create(int cls)
+{
+    struct slab *slab;
+    unsigned long page;
+    int i;
+
+    /* The payload is exactly the slab page */
+    if ((slab = alloc_aligned(SLAB_SIZE, ADJUST(SLAB_SIZE))) == NULL)
+        return NULL;
+
+    slab->objsize = (cls + 1) * ALIGNMENT;
+    slab->nobjs = (SLAB_SIZE - SLAB_HDR) / slab->objsize;
+    slab->nfree = slab->nobjs;
+    slab->cls = cls;
+    memset(slab->bitmap, 0, sizeof(slab->bitmap));
+    for (i = 0; i < slab->nobjs; ++i)
+        slab->bitmap[i / 32] |= 1u << (i % 32);
+
+    page = PAGE_INDEX(slab);
+    slab_pages[page / 8] |= 1 << (page % 8);
+    ++slab_empty[cls];
+    slab_link(slab);
+    return slab;
+}
+
+/*
+ * slab_link - Insert a slab at the head of its class list
+ */
+static void slab_link(struct slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = slab_lists[slab->cls];
+    if (slab->next)
+        slab->next->prev = slab;
+    slab_lists[slab->cls] = slab;
+}
+
+/*
+ * slab_unlink - Remove a slab from its class list
+ */
+static void slab_unlink(struct slab *slab)
+{
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        slab_lists[slab->cls] = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+}
+
+/*
+ * is_huge - Return whether ptr is a huge block, that is, lies outside
+ *     the heap
+ */
+static int is_huge(void *ptr)
+{
+    return (char *)ptr < (char *)mem_heap_lo() || (char *)ptr > (char *)mem_heap_hi();
+}
+
+/*
+ * huge_malloc - Give a request of size bytes a mapping of its own and
+ *     enter it in the registry
+ */
+static void *huge_malloc(size_t size)
+{
+    struct huge *huge;
+
+    if ((huge = mem_map(HUGE_MAPSIZE(size))) == (void *)-1)
+        return NULL;
+    huge->size = HUGE_MAPSIZE(size);
+    huge->prev = NULL;
+    huge->next = huge_list;
+    if (huge->next)
+        huge->next->prev = huge;
+    huge_list = huge;
+    return (char *)huge + HUGE_HDR;
+}
+
+/*
+ * huge_free - Remove a huge block from the registry and unmap it
+ */
+static void huge_free(void *ptr)
+{
+    struct huge *huge = HUGE_OF(ptr);
+
+    if (huge->prev)
+        huge->prev->next = huge->next;
+    else
+        huge_list = huge->next;
+    if (huge->next)
+        huge->next->prev = huge->prev;
+    mem_unmap(huge);
+}
+
+/*
+ * huge_realloc - Resize huge block ptr to size bytes. While it stays
+ *     huge it is remapped, which moves no data; otherwise the payload
+ *     is copied to a slab or the heap.
+ */
+static void *huge_realloc(void *ptr, size_t size)
+{
+    struct huge *huge = HUGE_OF(ptr);
+    void *newptr;
+
+    if (size < HUGE_THRESHOLD)
+    {
+        if (size <= SLAB_MAX)
+            newptr = slab_malloc(SLAB_CLASS(size));
+        else
+            newptr = malloc_block(ADJUST(size));
+        if (!newptr)
+            return 0;
+        memcpy(newptr, ptr, size);
+        huge_free(ptr);
+        return newptr;
+    }
+
+    if (HUGE_MAPSIZE(size) == huge->size)
+        return ptr;
+    if ((huge = mem_remap(huge, HUGE_MAPSIZE(size))) == (void *)-1)
+        return NULL;
+
+    /* The mapping may have moved, so relink it */
+    huge->size = HUGE_MAPSIZE(size);
+    if (huge->prev)
+        huge->prev->next = huge;
+    else
+        huge_list = huge;
+    if (huge->next)
+        huge->next->prev = huge;
+    return (char *)huge + HUGE_HDR;
+}
+
+/* 
+ * checkheap - Minimal check of the heap for consistency 
+ */
+void checkheap()
+{
+    /* Check implicit free lists */
+    size_t i;
+    if ((GET_SIZE(HDRP(heap_listp)) != PROLOGUE_SIZE) || !GET_ALLOC(HDRP(heap_listp)))
+        printf("Bad prologue header\n");
+
+    char *ptr;
+    size_t prev_alloc = 1;
+    for (ptr = heap_listp; GET_SIZE(HDRP(ptr)) > 0; ptr = NEXT_BLKP(ptr))
+    {
+        checkblock(ptr);
+        if (!GET_PREV_ALLOC(HDRP(ptr)) != !prev_alloc)
+            printf("Error: previous-allocated bit of %p is wrong\n", ptr);
+        prev_alloc = GET_ALLOC(HDRP(ptr));
+    }
+
+    if ((GET_SIZE(HDRP(ptr)) != 0) || !(GET_ALLOC(HDRP(ptr))) ||
+        !GET_PREV_ALLOC(HDRP(ptr)) != !prev_alloc)
+        printf("Bad epilogue header\n");
+    if (ptr != (char *)mem_heap_hi() + 1)
+        printf("Error: epilogue is not at the end of the heap\n");
+
+    /* Check explicit free lists and the bitmap of non-empty ones */
+    for (i = 0; i < TREE_CLASS; ++i)
+    {
+        for (ptr = SUCC_BLKP(CLASS_LIST(i)); ptr != CLASS_LIST(i); ptr = SUCC_BLKP(ptr))
+        {
+            checklist(ptr);
+            if (class(GET_SIZE(HDRP(ptr))) != (int)i)
+                printf("Error: %p is in the list of class %d\n", ptr, (int)i);
+        }
+        if (!((class_map >> i) & 1) != (SUCC_BLKP(CLASS_LIST(i)) == CLASS_LIST(i)))
+            printf("Error: bitmap bit of class %d is wrong\n", (int)i);
+    }
+
+    /* Check the quick lists, whose blocks still look allocated */
+    int count;
+    for (i = 0; i < QUICK_BINS; ++i)
+    {
+        count = 0;
+        for (ptr = quick_lists[i]; ptr != NULL; ptr = GETL(ptr))
+        {
+            ++count;
+            if (!GET_ALLOC(HDRP(ptr)) || QUICK_BIN(GET_SIZE(HDRP(ptr))) != (int)i)
+                printf("Error: %p on quick list %d is free or of another size\n", ptr, (int)i);
+        }
+        if (count != quick_count[i] || !((quick_map >> i) & 1) != !count)
+            printf("Error: quick list %d has %d blocks, expected %d\n", (int)i, count, quick_count[i]);
+    }
+
+    /* Check the tree of large free blocks */
+    checktree(tree_root, NULL, NULL);
+
+    /* Check slabs with free objects */
+    struct slab *slab;
+    for (i = 0; i < SLAB_CLASSES; ++i)
+        for (slab = slab_lists[i]; slab; slab = slab->next)
+            checkslab(slab);
+
+    /* Check the registry of huge blocks */
+    struct huge *huge;
+    for (huge = huge_list; huge; huge = huge->next)
+        checkhuge(huge);
+}
+
+static void checkblock(void *ptr)
+{
+    if ((size_t)ptr % ALIGNMENT)
+        printf("Error: %p is not aligned\n", ptr);
+    if (!GET_ALLOC(HDRP(ptr)) && GET_SIZE(HDRP(ptr)) != GET(FTRP(ptr)))
+        printf("Error: header does not match footer\n");
+    if (!GET_ALLOC(HDRP(ptr)) && !GET_PREV_ALLOC(HDRP(ptr)))
+        printf("Error: free block %p follows a free block\n", ptr);
+}
+
+static void checkslab(struct slab *slab)
+{
+    int i, nfree = 0;
+
+    if (!is_slab(slab) || !GET_ALLOC(HDRP(slab)))
+        printf("Error: slab %p is not an allocated slab page\n", slab);
+    for (i = 0; i < 16; ++i)
+        nfree += __builtin_popcount(slab->bitmap[i]);
+    if (nfree != slab->nfree || nfree == 0)
+        printf("Error: slab %p has %d free objects, expected %d\n", slab, nfree, slab->nfree);
+}
+
+static void checkhuge(struct huge *huge)
+{
+    char *ptr = (char *)huge + HUGE_HDR;
+
+    if (!is_huge(ptr) || (size_t)huge % mem_pagesize() || huge->size % mem_pagesize())
+        printf("Error: huge block %p is not a whole mapping\n", ptr);
+    if (huge->next && huge->next->prev != huge)
+        printf("Error: huge block %p is not linked to its successor\n", ptr);
+}
+
+/*
+ * checktree - Check the order, heap property and blocks of a subtree whose
+ *     blocks must order between lo and hi (if not NULL); return its size
+ */
+static size_t checktree(void *root, void *lo, void *hi)
+{
+    if (root == NULL)
+        return 0;
+    if (GET_ALLOC(HDRP(root)) || class(GET_SIZE(HDRP(root))) < TREE_CLASS)
+        printf("Error: %p in tree is allocated or too small\n", root);
+    if ((lo && !tree_less(lo, root)) || (hi && !tree_less(root, hi)))
+        printf("Error: %p in tree is out of order\n", root);
+    if ((LEFT(root) && PRIORITY(LEFT(root)) > PRIORITY(root)) ||
+        (RIGHT(root) && PRIORITY(RIGHT(root)) > PRIORITY(root)))
+        printf("Error: %p in tree violates the heap property\n", root);
+    return 1 + checktree(LEFT(root), lo, root) + checktree(RIGHT(root), root, hi);
+}
+
+static void checklist(void *ptr)
+{
+    if (SUCC_BLKP(PRED_BLKP(ptr)) != ptr)
+        printf("Error: consecutive pointers are not consistent");
+    if (GET_ALLOC(ptr))
+        printf("Error: %p in free list is allocated\n", ptr);
+}
+
+#ifdef MM_THREAD_SAFE
+/*
+ * tcache_malloc - Allocate a block or slab object of bin from this
+ *     thread's cache, refilling the bin with a batch if it is empty
+ */
+static void *tcache_malloc(int bin)
+{
+    int i;
+    void *ptr, *block;
+
+    tcache_check();
+    if ((ptr = tcache.bins[bin]) != NULL)
+    {
+        tcache.bins[bin] = GETA(ptr);
+        --tcache.count[bin];
+        return ptr;
+    }
+
+    HEAP_LOCK();
+    if ((ptr = tcache_take(bin)) == NULL)
+    {
+        /* Out of memory, give back what this thread is hoarding first */
+        for (i = 0; i < TCACHE_BINS; ++i)
+            tcache_flush(&tcache, i, 0);
+        ptr = tcache_take(bin);
+    }
+    for (i = 1; ptr && i < TCACHE_BATCH; ++i)
+    {
+        if ((block = tcache_take(bin)) == NULL)
+            break;
+        tcache_push(block, bin);
+    }
+    HEAP_UNLOCK();
+    return ptr;
+}
+
+/*
+ * tcache_free - Return a block or slab object to bin of this thread's
+ *     cache, flushing half of the bin to the heap if the bin is full
+ */
+static void tcache_free(void *ptr, int bin)
+{
+    tcache_check();
+    PUTA(ptr, tcache.bins[bin]);
+    tcache.bins[bin] = ptr;
+    if (++tcache.count[bin] > TCACHE_LIMIT)
+    {
+        HEAP_LOCK();
+        tcache_flush(&tcache, bin, TCACHE_LIMIT / 2);
+        HEAP_UNLOCK();
+    }
+}
+
+/*
+ * tcache_take - Take a block or slab object for bin from the heap, with
+ *     the heap locked
+ */
+static void *tcache_take(int bin)
+{
+    if (bin >= TCACHE_HEAP_BINS)
+        return slab_malloc(bin - TCACHE_HEAP_BINS);
+    return malloc_block(MIN_BLOCK + bin * DSIZE);
+}
+
+/*
+ * tcache_push - Cache a block taken for bin by a refill, with the heap
+ *     locked. A fit may be larger than requested, so a heap block goes to
+ *     the bin of its own size, or back to the heap if that is not cached.
+ */
+static void tcache_push(void *ptr, int bin)
+{
+    size_t size;
+
+    if (bin < TCACHE_HEAP_BINS)
+    {
+        size = GET_SIZE(HDRP(ptr));
+        if (size > TCACHE_MAX)
+        {
+            free_block(ptr);
+            return;
+        }
+        bin = TCACHE_BIN(size);
+    }
+    if (tcache.count[bin] >= TCACHE_LIMIT)
+    {
+        tcache_release(ptr, bin);
+        return;
+    }
+    PUTA(ptr, tcache.bins[bin]);
+    tcache.bins[bin] = ptr;
+    ++tcache.count[bin];
+}
+
+/*
+ * tcache_flush - Free the blocks of a bin until keep remain, with the
+ *     heap locked
+ */
+static void tcache_flush(struct tcache *tc, int bin, int keep)
+{
+    void *ptr;
+
+    while (tc->count[bin] > keep)
+    {
+        ptr = tc->bins[bin];
+        tc->bins[bin] = GETA(ptr);
+        --tc->count[bin];
+        tcache_release(ptr, bin);
+    }
+}
+
+/*
+ * tcache_release - Give a cached block or slab object of bin back to the
+ *     heap, with the heap locked
+ */
+static void tcache_release(void *ptr, int bin)
+{
+    if (bin >= TCACHE_HEAP_BINS)
+        slab_free(ptr);
+    else
+        free_block(ptr);
+}
+
+/*
+ * tcache_check - Empty this thread's cache if mm_init has since replaced
+ *     the heap its blocks came from. The first call in a thread also
+ *     registers the cache to be flushed when the thread exits.
+ */
+static void tcache_check(void)
+{
+    if (tcache.gen == heap_gen)
+        return;
+    memset(&tcache, 0, sizeof(struct tcache));
+    tcache.gen = heap_gen;
+    pthread_once(&tcache_once, tcache_key_create);
+    pthread_setspecific(tcache_key, &tcache);
+}
+
+static void tcache_key_create(void)
+{
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+/*
+ * tcache_destroy - Flush the cache of an exiting thread to the heap
+ */
+static void tcache_destroy(void *arg)
+{
+    struct tcache *tc = (struct tcache *)arg;
+    int i;
+
+    HEAP_LOCK();
+    if (tc->gen == heap_gen)
+        for (i = 0; i < TCACHE_BINS; ++i)
+            tcache_flush(tc, i, 0);
+    HEAP_UNLOCK();
+}
+
+/*
+ * atfork_register - Hold the heap lock across fork, so that the child
+ *     never inherits it held by a thread that does not exist there
+ */
+static void atfork_register(void)
+{
+    pthread_atfork(atfork_lock, atfork_unlock, atfork_unlock);
+}
+
+static void atfork_lock(void)
+{
+    HEAP_LOCK();
+}
+
+static void atfork_unlock(void)
+{
+    HEAP_UNLOCK();
 }
+#endif
@@ -4,8 +4,54 @@ extern int mm_init(void);
 extern void *mm_malloc(size_t size);
 extern void mm_free(void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+extern void *mm_calloc(size_t nmemb, size_t size);
+extern size_t mm_usable_size(void *ptr);
 extern void mm_check();
 
+/* Kinds of block reported by mm_walk */
+#define MM_BLOCK_ALLOC 0 /* allocated (or held by a thread's cache) */
+#define MM_BLOCK_FREE  1 /* free, on the list of its class */
+#define MM_BLOCK_QUICK 2 /* freed, on a quick list, not yet coalesced */
+#define MM_BLOCK_SLAB  3 /* a slab of small objects */
+#define MM_BLOCK_KINDS 4
+
+/* Called by mm_walk for each block: cls is the free list class of a free
+   block and -1 for the others */
+typedef void (*mm_walker_t)(void *arg, void *ptr, size_t size, int kind, int cls);
+extern void mm_walk(mm_walker_t fn, void *arg);
+
+/* Statistics filled in by mm_stats. The counters are kept only when mm.c
+   is built with -DMM_STATS, and read 0 otherwise */
+#define MM_STATS_CLASSES 64 /* at least the number of free list classes */
+typedef struct
+{
+    int counted;              /* nonzero if built with -DMM_STATS */
+    size_t heap;              /* bytes of heap */
+    size_t heap_peak;         /* most bytes of heap since mm_init (counter) */
+    size_t mapped;            /* bytes mapped for huge blocks */
+    size_t in_use;            /* bytes of allocated blocks and slab objects */
+    size_t free;              /* bytes of free blocks */
+    size_t quick;             /* bytes of blocks on the quick lists */
+    size_t slab_spare;        /* bytes of slabs not in allocated objects */
+    int classes;              /* free list classes in use */
+    size_t class_free[MM_STATS_CLASSES]; /* bytes of free blocks per class */
+
+    /* Counters, since mm_init */
+    unsigned long extends;    /* times the heap grew with mem_sbrk */
+    unsigned long trims;      /* times the heap shrank */
+    unsigned long splits;     /* blocks split, the rest given back */
+    unsigned long coalesces;  /* free neighbours merged into a block */
+    unsigned long fits;       /* free list searches */
+    unsigned long probes;     /* free blocks looked at by the searches */
+    unsigned long max_probes; /* most free blocks looked at by one search */
+} mm_stats_t;
+extern void mm_stats(mm_stats_t *stats);
+
+/* Nonzero if built with -DMM_THREAD_SAFE */
+extern const int mm_thread_safe;
+
 /* 
  * Students work in teams of one or two.  Teams enter their team name, 
  * personal names and login IDs in a struct of this
@@ -0,0 +1,149 @@
+/*
+ * mm_preload.c - Replace the C library's malloc with mm.c in real programs
+ *
+ * Built into libmm.so together with the thread-safe build of mm.c and
+ * memarena.c, which gives mm.c real memory in place of memlib's model,
+ * so that any dynamically linked program can run on it:
+ *
+ *     unix> make libmm.so
+ *     unix> LD_PRELOAD=./libmm.so ls -l
+ *
+ * Only the functions below are exported; everything else in the library
+ * is hidden, so that it cannot clash with names in the program. Blocks
+ * are aligned to ALIGNMENT bytes, as mm_malloc aligns them, unless a
+ * larger alignment is asked for.
+ */
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+/* Both memlib.h and mm.c are set up by the first call */
+static int initialized = 0;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static void init(void);
+static void *alloc_failed(void *ptr);
+
+#define INIT() if (!initialized) pthread_once(&init_once, init)
+
+EXPORT void *malloc(size_t size)
+{
+    INIT();
+    /* Callers expect a unique pointer for 0 bytes, mm_malloc gives NULL */
+    return alloc_failed(mm_malloc(size ? size : 1));
+}
+
+EXPORT void free(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+    mm_free(ptr);
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size)
+{
+    if (size && nmemb > (size_t)-1 / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    INIT();
+    if (nmemb == 0 || size == 0)
+        nmemb = size = 1;
+    return alloc_failed(mm_calloc(nmemb, size));
+}
+
+EXPORT void *realloc(void *ptr, size_t size)
+{
+    INIT();
+    if (ptr == NULL)
+        return malloc(size);
+    if (size == 0) {
+        mm_free(ptr);
+        return NULL;
+    }
+    return alloc_failed(mm_realloc(ptr, size));
+}
+
+EXPORT void *reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+    if (size && nmemb > (size_t)-1 / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, nmemb * size);
+}
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *ptr;
+
+    if (alignment % sizeof(void *) || (alignment & (alignment - 1)))
+        return EINVAL;
+    INIT();
+    if ((ptr = mm_memalign(alignment, size ? size : 1)) == NULL)
+        return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+EXPORT void *memalign(size_t alignment, size_t size)
+{
+    if (alignment & (alignment - 1)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    INIT();
+    return alloc_failed(mm_memalign(alignment, size ? size : 1));
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+    INIT();
+    return alloc_failed(mm_aligned_alloc(alignment, size ? size : 1));
+}
+
+EXPORT void *valloc(size_t size)
+{
+    return memalign(mem_pagesize(), size);
+}
+
+EXPORT void *pvalloc(size_t size)
+{
+    return memalign(mem_pagesize(), (size + mem_pagesize() - 1) & ~(mem_pagesize() - 1));
+}
+
+EXPORT size_t malloc_usable_size(void *ptr)
+{
+    return mm_usable_size(ptr);
+}
+
+/*
+ * init - Reserve the heap and initialize mm.c, once per process
+ */
+static void init(void)
+{
+    mem_init();
+    if (mm_init() < 0)
+        abort();
+    initialized = 1;
+}
+
+/*
+ * alloc_failed - Set errno as the C library does if an allocation
+ *     returned NULL, and pass the result on
+ */
+static void *alloc_failed(void *ptr)
+{
+    if (ptr == NULL)
+        errno = ENOMEM;
+    return ptr;
+}
@@ -0,0 +1,186 @@
+/*
+ * mmbench.c - Multithreaded throughput benchmark for the malloc package
+ *
+ * Each thread churns a private set of slots, freeing the block in a
+ * randomly chosen slot if there is one and allocating a small block of
+ * random size otherwise. The run is repeated with 1, 2, 4, ... threads
+ * to show how throughput scales. mm.c must be built with -DMM_THREAD_SAFE
+ * (see the mmbench target of the Makefile).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+/* Misc */
+#define SLOTS       512 /* live blocks per thread */
+#define MAXSIZE     256 /* largest request */
+#define MAXTHREADS   16 /* default limit, so the heap holds every working set */
+
+/* Parameters and result of one benchmark thread */
+typedef struct {
+    int id;
+    long ops;      /* requests to issue */
+    int use_libc;  /* use libc malloc instead of mm.c */
+} bench_t;
+
+static void *bench_thread(void *vargp);
+static double run(int nthreads, long ops, int use_libc);
+static void usage(void);
+
+int main(int argc, char **argv)
+{
+    int c, nthreads;
+    int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    long ops = 1000000;
+    int run_libc = 0;
+    double base = 0, rate, lbase = 0, lrate = 0;
+
+    if (max_threads > MAXTHREADS)
+        max_threads = MAXTHREADS;
+    while ((c = getopt(argc, argv, "t:n:lh")) != EOF) {
+        switch (c) {
+        case 't': /* Largest thread count */
+            max_threads = atoi(optarg);
+            break;
+        case 'n': /* Requests per thread */
+            ops = atol(optarg);
+            break;
+        case 'l': /* Compare against libc malloc */
+            run_libc = 1;
+            break;
+        case 'h':
+        default:
+            usage();
+            exit(c == 'h' ? 0 : 1);
+        }
+    }
+    if (max_threads < 1 || ops < 1) {
+        usage();
+        exit(1);
+    }
+    if (!mm_thread_safe) {
+        fprintf(stderr, "mmbench: mm.c was not built with -DMM_THREAD_SAFE\n");
+        exit(1);
+    }
+
+    mem_init();
+    printf("%8s %10s %8s", "threads", "mm Kops", "speedup");
+    if (run_libc)
+        printf(" %10s %8s", "libc Kops", "speedup");
+    printf("\n");
+    for (nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+        rate = run(nthreads, ops, 0);
+        if (nthreads == 1)
+            base = rate;
+        printf("%8d %10.0f %8.2f", nthreads, rate / 1e3, rate / base);
+        if (run_libc) {
+            lrate = run(nthreads, ops, 1);
+            if (nthreads == 1)
+                lbase = lrate;
+            printf(" %10.0f %8.2f", lrate / 1e3, lrate / lbase);
+        }
+        printf("\n");
+    }
+    mem_deinit();
+    exit(0);
+}
+
+/*
+ * run - Run nthreads benchmark threads of ops requests each on a fresh
+ *     heap and return the aggregate requests per second
+ */
+static double run(int nthreads, long ops, int use_libc)
+{
+    pthread_t *tids = malloc(nthreads * sizeof(pthread_t));
+    bench_t *params = malloc(nthreads * sizeof(bench_t));
+    struct timeval start, end;
+    double secs;
+    int i;
+
+    if (!use_libc) {
+        mem_reset_brk();
+        if (mm_init() < 0) {
+            fprintf(stderr, "mmbench: mm_init failed\n");
+            exit(1);
+        }
+    }
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < nthreads; i++) {
+        params[i].id = i;
+        params[i].ops = ops;
+        params[i].use_libc = use_libc;
+        if (pthread_create(&tids[i], NULL, bench_thread, &params[i]) != 0) {
+            fprintf(stderr, "mmbench: pthread_create failed\n");
+            exit(1);
+        }
+    }
+    for (i = 0; i < nthreads; i++)
+        pthread_join(tids[i], NULL);
+    gettimeofday(&end, NULL);
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    free(tids);
+    free(params);
+    return nthreads * ops / secs;
+}
+
+/*
+ * bench_thread - Issue the requests of one thread
+ */
+static void *bench_thread(void *vargp)
+{
+    bench_t *param = (bench_t *)vargp;
+    char *slots[SLOTS];
+    unsigned int seed = 2654435761u * (param->id + 1);
+    size_t size;
+    long i;
+    int j;
+
+    memset(slots, 0, sizeof(slots));
+    for (i = 0; i < param->ops; i++) {
+        seed = seed * 1103515245 + 12345;
+        j = (seed >> 8) % SLOTS;
+        if (slots[j]) {
+            if (param->use_libc)
+                free(slots[j]);
+            else
+                mm_free(slots[j]);
+            slots[j] = NULL;
+            continue;
+        }
+        /* Favor small requests, as real programs do */
+        size = 1 + ((seed >> 16) % MAXSIZE) * ((seed >> 24) % 4 + 1) / 4;
+        slots[j] = param->use_libc ? malloc(size) : mm_malloc(size);
+        if (slots[j] == NULL) {
+            fprintf(stderr, "mmbench: out of memory\n");
+            exit(1);
+        }
+        slots[j][0] = slots[j][size - 1] = (char)j;
+    }
+
+    for (j = 0; j < SLOTS; j++) {
+        if (param->use_libc)
+            free(slots[j]);
+        else
+            mm_free(slots[j]);
+    }
+    return NULL;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: mmbench [-hl] [-t <threads>] [-n <ops>]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h            Print this message.\n");
+    fprintf(stderr, "\t-l            Run libc malloc as well.\n");
+    fprintf(stderr, "\t-n <ops>      Requests per thread (default 1000000).\n");
+    fprintf(stderr, "\t-t <threads>  Largest thread count (default: cores, at most %d).\n",
+            MAXTHREADS);
+}
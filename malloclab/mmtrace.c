@@ -0,0 +1,543 @@
+/*
+ * mmtrace.c - Record the allocation requests of a real program as a
+ *     trace file that mdriver can replay
+ *
+ * Built into libmmtrace.so, which interposes on the C library's
+ * allocator:
+ *
+ *     unix> make libmmtrace.so
+ *     unix> MMTRACE=ls.%p.rep LD_PRELOAD=./libmmtrace.so ls -l
+ *
+ * writes ls.<pid>.rep when ls exits (MMTRACE defaults to
+ * mmtrace.%p.rep, and %p stands for the process id, so programs that
+ * the traced one runs do not overwrite its trace).
+ *
+ * Recording must be cheap, so the program's threads never wait for
+ * each other. Each thread appends fixed-size events to its own buffer
+ * and writes the buffer to a raw event file in one append when it
+ * fills up, or when the thread exits. Events are ordered across
+ * threads by a sequence number taken with one atomic increment: after
+ * a block is allocated, and before it is freed. A block can therefore
+ * not be handed to another thread before the event that released it.
+ * A realloc takes one number before the call, to release the old
+ * block, and one after it, to take the new one.
+ *
+ * At exit the events are put back in sequence order, the blocks are
+ * given request ids, and the trace is written out. Blocks still
+ * allocated at exit are freed at the end of the trace, as checktrace.pl
+ * does, so the trace is balanced. Frees of blocks allocated before
+ * recording started (for instance, by the parent of a forked child) are
+ * left out. A process that is killed, or that calls exec, leaves only
+ * the raw event file behind.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define EXPORT __attribute__((visibility("default")))
+
+/* glibc's own allocator, which does the real work */
+extern void *__libc_malloc(size_t size);
+extern void __libc_free(void *ptr);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+/* Event types */
+#define EV_ALLOC   1 /* ptr was allocated with size bytes */
+#define EV_FREE    2 /* ptr is being freed */
+#define EV_RELEASE 3 /* ptr is being passed to realloc */
+#define EV_REALLOC 4 /* the realloc whose EV_RELEASE is link returned ptr */
+
+typedef struct {
+    unsigned long seq;   /* position in the order of all events */
+    unsigned long ptr;   /* block address */
+    unsigned long size;  /* requested bytes (EV_ALLOC and EV_REALLOC) */
+    unsigned long link;  /* sequence number of the EV_RELEASE (EV_REALLOC) */
+    int type;            /* EV_xxx, or 0 for a sequence number never used */
+} event_t;
+
+/* Events a thread buffers before writing them out (256 KB) */
+#define BUF_EVENTS (1 << 13)
+
+/* A thread's buffer. Buffers of exited threads are reused. */
+typedef struct buf {
+    struct buf *next;    /* next buffer in bufs */
+    int free;            /* 1 if no thread owns this buffer */
+    int count;           /* events in ev */
+    event_t ev[BUF_EVENTS];
+} buf_t;
+
+static buf_t *bufs;                 /* every buffer ever created */
+static __thread buf_t *mybuf;       /* this thread's buffer */
+static unsigned long next_seq;      /* the next sequence number */
+static int recording;               /* 0 before startup and after exit */
+static int raw_fd = -1;             /* the raw event file */
+static pthread_key_t exit_key;      /* flushes mybuf when a thread exits */
+
+static char trace_path[4096];       /* the trace being recorded */
+static char raw_path[4096 + 4];     /* its raw events (trace_path.raw) */
+
+/* Function prototypes for internal helper routines */
+static void record(int type, void *ptr, size_t size, unsigned long link);
+static unsigned long take_seq(void);
+static buf_t *get_buf(void);
+static void flush(buf_t *buf);
+static void thread_exit(void *arg);
+static void open_raw(void);
+static void fork_child(void);
+static void write_trace(void);
+static void ids_insert(unsigned long key, unsigned long id);
+static int ids_remove(unsigned long key, unsigned long *id);
+
+/*
+ * The interposed allocator
+ */
+EXPORT void *malloc(size_t size)
+{
+    void *ptr = __libc_malloc(size);
+
+    if (ptr && recording)
+	record(EV_ALLOC, ptr, size, 0);
+    return ptr;
+}
+
+EXPORT void free(void *ptr)
+{
+    if (ptr && recording)
+	record(EV_FREE, ptr, 0, 0);
+    __libc_free(ptr);
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size)
+{
+    void *ptr = __libc_calloc(nmemb, size);
+
+    if (ptr && recording)
+	record(EV_ALLOC, ptr, nmemb * size, 0);
+    return ptr;
+}
+
+EXPORT void *realloc(void *ptr, size_t size)
+{
+    unsigned long seq;
+    void *newptr;
+
+    if (ptr == NULL)
+	return malloc(size);
+    if (!recording)
+	return __libc_realloc(ptr, size);
+    if (size == 0) {
+	free(ptr);
+	return NULL;
+    }
+
+    seq = take_seq();
+    record(EV_RELEASE, ptr, 0, seq);
+    newptr = __libc_realloc(ptr, size);
+    /* On failure the old block is still the program's */
+    record(EV_REALLOC, newptr ? newptr : ptr, newptr ? size : 0, seq);
+    return newptr;
+}
+
+/* The trace format has no alignments, so these are plain allocations */
+EXPORT void *memalign(size_t alignment, size_t size)
+{
+    void *ptr = __libc_memalign(alignment, size);
+
+    if (ptr && recording)
+	record(EV_ALLOC, ptr, size, 0);
+    return ptr;
+}
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *ptr;
+
+    if (alignment % sizeof(void *) || (alignment & (alignment - 1)))
+	return EINVAL;
+    if ((ptr = memalign(alignment, size)) == NULL)
+	return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+EXPORT void *valloc(size_t size)
+{
+    return memalign(getpagesize(), size);
+}
+
+/*
+ * record - Append an event to this thread's buffer. link is the
+ *     sequence number to use for EV_RELEASE.
+ */
+static void record(int type, void *ptr, size_t size, unsigned long link)
+{
+    buf_t *buf = mybuf ? mybuf : get_buf();
+    event_t *ev;
+
+    if (buf == NULL)
+	return;
+    ev = &buf->ev[buf->count];
+    ev->seq = type == EV_RELEASE ? link : take_seq();
+    ev->ptr = (unsigned long)ptr;
+    ev->size = size;
+    ev->link = link;
+    ev->type = type;
+    /* Publish the event before the count, for write_trace's final flush */
+    __atomic_store_n(&buf->count, buf->count + 1, __ATOMIC_RELEASE);
+    if (buf->count == BUF_EVENTS)
+	flush(buf);
+}
+
+static unsigned long take_seq(void)
+{
+    return __atomic_fetch_add(&next_seq, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * get_buf - Give this thread a buffer, reusing one whose thread exited
+ */
+static buf_t *get_buf(void)
+{
+    buf_t *buf;
+
+    for (buf = __atomic_load_n(&bufs, __ATOMIC_ACQUIRE); buf; buf = buf->next) {
+	int one = 1;
+	if (__atomic_load_n(&buf->free, __ATOMIC_RELAXED) &&
+	    __atomic_compare_exchange_n(&buf->free, &one, 0, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	    break;
+    }
+    if (buf == NULL) {
+	buf = mmap(NULL, sizeof(buf_t), PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED)
+	    return NULL;
+	buf->next = __atomic_load_n(&bufs, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&bufs, &buf->next, buf, 1,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	    ;
+    }
+    mybuf = buf;
+    /* Setting the key's value makes thread_exit run when the thread exits */
+    pthread_setspecific(exit_key, buf);
+    return buf;
+}
+
+/*
+ * flush - Append a buffer's events to the raw event file. A single
+ *     write with O_APPEND does not mix with those of other threads.
+ */
+static void flush(buf_t *buf)
+{
+    char *p = (char *)buf->ev;
+    size_t left = __atomic_load_n(&buf->count, __ATOMIC_ACQUIRE) * sizeof(event_t);
+    ssize_t n;
+
+    while (left > 0 && (n = write(raw_fd, p, left)) > 0) {
+	p += n;
+	left -= n;
+    }
+    buf->count = 0;
+}
+
+/*
+ * thread_exit - Flush the buffer of an exiting thread and free it up
+ */
+static void thread_exit(void *arg)
+{
+    buf_t *buf = arg;
+
+    if (__atomic_load_n(&recording, __ATOMIC_ACQUIRE))
+	flush(buf);
+    mybuf = NULL;
+    __atomic_store_n(&buf->free, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * open_raw - Work out the trace's name and create its raw event file
+ */
+static void open_raw(void)
+{
+    char *fmt = getenv("MMTRACE");
+    char *p;
+    size_t len = 0;
+
+    if (fmt == NULL || *fmt == '\0')
+	fmt = "mmtrace.%p.rep";
+    for (p = fmt; *p && len < sizeof(trace_path) - 24; p++) {
+	if (p[0] == '%' && p[1] == 'p') {
+	    len += sprintf(trace_path + len, "%d", (int)getpid());
+	    p++;
+	}
+	else
+	    trace_path[len++] = *p;
+    }
+    trace_path[len] = '\0';
+    sprintf(raw_path, "%s.raw", trace_path);
+
+    raw_fd = open(raw_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+		  0644);
+    if (raw_fd < 0) {
+	fprintf(stderr, "mmtrace: cannot create %s\n", raw_path);
+	return;
+    }
+    __atomic_store_n(&recording, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * start - Begin recording when the library is loaded
+ */
+__attribute__((constructor))
+static void start(void)
+{
+    pthread_key_create(&exit_key, thread_exit);
+    pthread_atfork(NULL, NULL, fork_child);
+    open_raw();
+}
+
+/*
+ * fork_child - Give a forked child its own trace. The parent writes
+ *     the events it had buffered, and the child's other threads are
+ *     gone, so the child starts with empty buffers.
+ */
+static void fork_child(void)
+{
+    buf_t *buf;
+
+    if (!recording)
+	return;
+    recording = 0;
+    for (buf = bufs; buf; buf = buf->next) {
+	buf->count = 0;
+	if (buf != mybuf)
+	    buf->free = 1;
+    }
+    close(raw_fd);
+    open_raw();
+}
+
+/*
+ * stop - Write the trace when the process exits
+ */
+__attribute__((destructor))
+static void stop(void)
+{
+    buf_t *buf;
+
+    if (!__atomic_exchange_n(&recording, 0, __ATOMIC_ACQ_REL))
+	return;
+    /* Threads still running lose the events they record from now on */
+    for (buf = __atomic_load_n(&bufs, __ATOMIC_ACQUIRE); buf; buf = buf->next)
+	flush(buf);
+    close(raw_fd);
+    write_trace();
+}
+
+/*
+ * ids maps the address of each allocated block, and the sequence number
+ * of each realloc in progress, to its request id. It is an open
+ * addressing hash table with linear probing. Sequence numbers have the
+ * top bit set, which user-space addresses never have.
+ */
+#define IN_REALLOC (1UL << 63)
+
+typedef struct {
+    unsigned long key;   /* 0 for an empty slot */
+    unsigned long id;
+} slot_t;
+
+static slot_t *ids;
+static unsigned long ids_mask;  /* table size - 1 */
+static unsigned long ids_count;
+
+#define HASH(key) (((key) * 0x9e3779b97f4a7c15UL) >> 20)
+
+static void ids_insert(unsigned long key, unsigned long id)
+{
+    unsigned long i;
+
+    if (2 * (ids_count + 1) > ids_mask + 1) {
+	slot_t *old = ids;
+	unsigned long n = ids_mask + 1;
+
+	ids = calloc(2 * n, sizeof(slot_t));
+	ids_mask = 2 * n - 1;
+	ids_count = 0;
+	for (i = 0; i < n; i++)
+	    if (old[i].key)
+		ids_insert(old[i].key, old[i].id);
+	free(old);
+    }
+    for (i = HASH(key) & ids_mask; ids[i].key; i = (i + 1) & ids_mask)
+	;
+    ids[i].key = key;
+    ids[i].id = id;
+    ids_count++;
+}
+
+/*
+ * ids_remove - Remove key, storing its id, and close the gap by moving
+ *     back the entries that probed past it. Returns 0 if key is absent.
+ */
+static int ids_remove(unsigned long key, unsigned long *id)
+{
+    unsigned long i, j, home;
+
+    for (i = HASH(key) & ids_mask; ids[i].key != key; i = (i + 1) & ids_mask)
+	if (ids[i].key == 0)
+	    return 0;
+    *id = ids[i].id;
+    for (j = (i + 1) & ids_mask; ids[j].key; j = (j + 1) & ids_mask) {
+	home = HASH(ids[j].key) & ids_mask;
+	/* Move j into the gap at i unless its home lies in (i, j] */
+	if (((j - home) & ids_mask) >= ((j - i) & ids_mask)) {
+	    ids[i] = ids[j];
+	    i = j;
+	}
+    }
+    ids[i].key = 0;
+    ids_count--;
+    return 1;
+}
+
+/*
+ * write_trace - Turn the raw events into the trace, and remove them
+ */
+static void write_trace(void)
+{
+    int fd = open(raw_path, O_RDONLY);
+    struct stat st;
+    event_t *ev, **order;
+    unsigned long n, i, first, last, span;
+    unsigned long num_ids = 0, num_ops = 0, id;
+    size_t live = 0, peak = 0, *sizes = NULL, sizes_len = 0;
+    char *ops_type;
+    unsigned long *ops_id, *ops_size;
+    FILE *fp;
+
+    if (fd < 0 || fstat(fd, &st) < 0)
+	return;
+    n = st.st_size / sizeof(event_t);
+    ev = n ? mmap(NULL, n * sizeof(event_t), PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (ev == MAP_FAILED)
+	return;
+
+    /* Put the events in sequence order. There are few gaps. */
+    first = last = 0;
+    for (i = 0; i < n; i++) {
+	if (i == 0 || ev[i].seq < first)
+	    first = ev[i].seq;
+	if (i == 0 || ev[i].seq > last)
+	    last = ev[i].seq;
+    }
+    span = n ? last - first + 1 : 0;
+    order = calloc(span + 1, sizeof(event_t *));
+    for (i = 0; i < n; i++)
+	order[ev[i].seq - first] = &ev[i];
+
+    /* Each event becomes at most one request, and each live block a free */
+    ops_type = malloc(2 * n + 1);
+    ops_id = malloc((2 * n + 1) * sizeof(unsigned long));
+    ops_size = malloc((2 * n + 1) * sizeof(unsigned long));
+    ids_mask = 1023;
+    ids = calloc(ids_mask + 1, sizeof(slot_t));
+
+#define EMIT(t, i, s) (ops_type[num_ops] = (t), ops_id[num_ops] = (i), \
+		       ops_size[num_ops++] = (s))
+#define SET_SIZE(i, s) do {						\
+	if ((i) >= sizes_len) {						\
+	    sizes_len = 2 * (i) + 1024;					\
+	    sizes = realloc(sizes, sizes_len * sizeof(size_t));		\
+	}								\
+	live += (s);							\
+	sizes[i] = (s);							\
+	if (live > peak)						\
+	    peak = live;						\
+    } while (0)
+
+    for (i = 0; i < span; i++) {
+	event_t *e = order[i];
+
+	if (e == NULL)
+	    continue;
+	switch (e->type) {
+	case EV_ALLOC:
+	    /* mdriver rejects 0-byte requests; malloc(0) has a block anyway */
+	    id = num_ids++;
+	    ids_insert(e->ptr, id);
+	    SET_SIZE(id, e->size ? e->size : 1);
+	    EMIT('a', id, sizes[id]);
+	    break;
+	case EV_FREE:
+	    if (ids_remove(e->ptr, &id)) {
+		live -= sizes[id];
+		EMIT('f', id, 0);
+	    }
+	    break;
+	case EV_RELEASE:
+	    if (ids_remove(e->ptr, &id))
+		ids_insert(e->seq | IN_REALLOC, id);
+	    break;
+	case EV_REALLOC:
+	    if (!ids_remove(e->link | IN_REALLOC, &id)) {
+		/* A block from before recording started */
+		if (e->size == 0)
+		    break;
+		id = num_ids++;
+		ids_insert(e->ptr, id);
+		SET_SIZE(id, e->size);
+		EMIT('a', id, e->size);
+		break;
+	    }
+	    ids_insert(e->ptr, id);
+	    if (e->size == 0)
+		break;     /* realloc failed, and changed nothing */
+	    live -= sizes[id];
+	    SET_SIZE(id, e->size);
+	    EMIT('r', id, e->size);
+	    break;
+	}
+    }
+    for (i = 0; i <= ids_mask; i++)
+	if (ids[i].key)
+	    EMIT('f', ids[i].id, 0);
+
+    if ((fp = fopen(trace_path, "w")) != NULL) {
+	/* The unused heap size field gets the peak of live bytes */
+	fprintf(fp, "%lu\n%lu\n%lu\n1\n", (unsigned long)peak, num_ids, num_ops);
+	for (i = 0; i < num_ops; i++) {
+	    if (ops_type[i] == 'f')
+		fprintf(fp, "f %lu\n", ops_id[i]);
+	    else
+		fprintf(fp, "%c %lu %lu\n", ops_type[i], ops_id[i], ops_size[i]);
+	}
+	fclose(fp);
+	unlink(raw_path);
+    }
+    else
+	fprintf(stderr, "mmtrace: cannot create %s\n", trace_path);
+
+    if (ev)
+	munmap(ev, n * sizeof(event_t));
+    free(order);
+    free(ops_type);
+    free(ops_id);
+    free(ops_size);
+    free(ids);
+    free(sizes);
+}
@@ -0,0 +1,95 @@
+/*
+ * rep2bin.c - Convert a text trace (.rep) to the binary trace format
+ *     described in bintrace.h
+ *
+ * usage: rep2bin <in.rep> <out.bin>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "bintrace.h"
+
+static void put_varint(FILE *fp, unsigned long val);
+static void rep_error(char *path, unsigned long op, char *msg);
+
+int main(int argc, char **argv)
+{
+    FILE *in, *out;
+    char type[2];
+    unsigned long header[4], op, index, size;
+    int i;
+
+    if (argc != 3) {
+	fprintf(stderr, "usage: rep2bin <in.rep> <out.bin>\n");
+	exit(1);
+    }
+    if ((in = fopen(argv[1], "r")) == NULL) {
+	fprintf(stderr, "rep2bin: %s: %s\n", argv[1], strerror(errno));
+	exit(1);
+    }
+    if ((out = fopen(argv[2], "wb")) == NULL) {
+	fprintf(stderr, "rep2bin: %s: %s\n", argv[2], strerror(errno));
+	exit(1);
+    }
+
+    /* Copy the header: heap size, ids, requests and weight */
+    fwrite(BINTRACE_MAGIC, 1, BINTRACE_MAGIC_LEN, out);
+    for (i = 0; i < 4; i++) {
+	if (fscanf(in, "%lu", &header[i]) != 1)
+	    rep_error(argv[1], 0, "bad header");
+	put_varint(out, header[i]);
+    }
+
+    /* Then each request */
+    for (op = 0; fscanf(in, "%1s", type) == 1; op++) {
+	if (fscanf(in, "%lu", &index) != 1)
+	    rep_error(argv[1], op, "missing id");
+	switch (type[0]) {
+	case 'a':
+	case 'r':
+	    if (fscanf(in, "%lu", &size) != 1)
+		rep_error(argv[1], op, "missing size");
+	    put_varint(out, index << 2 | 
+		       (type[0] == 'a' ? BINTRACE_ALLOC : BINTRACE_REALLOC));
+	    put_varint(out, size);
+	    break;
+	case 'f':
+	    put_varint(out, index << 2 | BINTRACE_FREE);
+	    break;
+	default:
+	    rep_error(argv[1], op, "bogus type character");
+	}
+    }
+    if (op != header[2])
+	rep_error(argv[1], op, "request count does not match the header");
+
+    fclose(in);
+    if (fclose(out) != 0) {
+	fprintf(stderr, "rep2bin: %s: %s\n", argv[2], strerror(errno));
+	exit(1);
+    }
+    exit(0);
+}
+
+/*
+ * put_varint - Write val as an unsigned LEB128 varint
+ */
+static void put_varint(FILE *fp, unsigned long val)
+{
+    while (val >= 0x80) {
+	putc((val & 0x7f) | 0x80, fp);
+	val >>= 7;
+    }
+    putc(val, fp);
+}
+
+/*
+ * rep_error - Report a malformed text trace and exit
+ */
+static void rep_error(char *path, unsigned long op, char *msg)
+{
+    fprintf(stderr, "rep2bin: %s, request %lu: %s\n", path, op, msg);
+    exit(1);
+}
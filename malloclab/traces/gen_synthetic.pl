@@ -0,0 +1,215 @@
+#!/usr/bin/perl
+#!/usr/local/bin/perl
+use Getopt::Std;
+
+#######################################################################
+# gen_synthetic - generate a trace from parameterized distributions
+#
+# Block sizes come from a size distribution, and the lifetime policy
+# decides which live block is freed whenever the next allocation would
+# take the live bytes past the target peak. Before a fraction of the
+# allocations a live block grows with realloc. The same seed always
+# gives the same trace.
+#
+#######################################################################
+
+#
+# void usage(void) - print help message and terminate
+#
+sub usage
+{
+    printf STDERR "$_[0]\n";
+    printf STDERR "Usage: $0 [-h] [-o <file>] [-n <blocks>] [-d <dist>] [-m <min>] [-M <max>]\n";
+    printf STDERR "       [-a <alpha>] [-b <frac>] [-c <sizes>] [-l <policy>] [-p <bytes>]\n";
+    printf STDERR "       [-r <frac>] [-g <growth>] [-s <seed>]\n";
+    printf STDERR "Options:\n";
+    printf STDERR "  -h          Print this message\n";
+    printf STDERR "  -o <file>   Output trace (default synthetic.rep)\n";
+    printf STDERR "  -n <blocks> Number of allocate requests (default 20000)\n";
+    printf STDERR "  -d <dist>   Size distribution: uniform, power, bimodal or classes\n";
+    printf STDERR "              (default power)\n";
+    printf STDERR "  -m <min>    Smallest block size (default 8)\n";
+    printf STDERR "  -M <max>    Largest block size (default 16384)\n";
+    printf STDERR "  -a <alpha>  Exponent of the power law (default 1.2)\n";
+    printf STDERR "  -b <frac>   Fraction of large blocks for bimodal (default 0.1)\n";
+    printf STDERR "  -c <sizes>  Comma separated sizes for classes (default 16,24,32,48,64,128,256)\n";
+    printf STDERR "  -l <policy> Which block dies: lifo, fifo, random or gen (default random)\n";
+    printf STDERR "  -p <bytes>  Target peak of live bytes (default 524288)\n";
+    printf STDERR "  -r <frac>   Fraction of allocations preceded by a realloc (default 0)\n";
+    printf STDERR "  -g <growth> Realloc growth: *<factor> or +<bytes> (default *1.5)\n";
+    printf STDERR "  -s <seed>   Random seed (default 1)\n";
+    die "\n" ;
+}
+
+#
+# int block_size(void) - draw a block size from the size distribution
+#
+sub block_size
+{
+    my ($u, $lo, $hi);
+
+    if ($dist eq "uniform") {
+        return $min_size + int(rand($max_size - $min_size + 1));
+    }
+    if ($dist eq "power") {
+        # Inverse CDF of the power law bounded by min_size and max_size
+        $u = rand;
+        $lo = $min_size ** -$alpha;
+        $hi = $max_size ** -$alpha;
+        return int(($lo - $u * ($lo - $hi)) ** (-1 / $alpha));
+    }
+    if ($dist eq "bimodal") {
+        # Two modes, within 25% of min_size and of max_size
+        if (rand() < $large_frac) {
+            return int($max_size * (0.75 + rand(0.25)));
+        }
+        return int($min_size * (1 + rand(0.25)));
+    }
+    return $classes[int(rand(@classes))];
+}
+
+#
+# int grow(int size) - the size a block grows to when it is reallocated
+#
+sub grow
+{
+    my ($size) = @_;
+
+    if ($growth =~ /^\+(\d+)$/) {
+        return $size + $1;
+    }
+    if ($growth =~ /^\*([\d.]+)$/) {
+        return int($size * $1) > $size ? int($size * $1) : $size + 1;
+    }
+    usage("Bad growth: $growth");
+}
+
+#
+# int victim(void) - remove a live block chosen by the lifetime
+#     policy from @live, and return its id
+#
+sub victim
+{
+    my ($i, $young);
+
+    if ($policy eq "lifo") {
+        return pop @live;
+    }
+    if ($policy eq "fifo") {
+        return shift @live;
+    }
+    if ($policy eq "gen") {
+        # Most blocks die young: GEN_YOUNG_DEATHS of the frees take one
+        # of the newest GEN_YOUNG of the live blocks, the rest an old one
+        $young = int(@live * $GEN_YOUNG) || 1;
+        if (rand() < $GEN_YOUNG_DEATHS || $young == @live) {
+            $i = @live - 1 - int(rand($young));
+        } else {
+            $i = int(rand(@live - $young));
+        }
+        return splice(@live, $i, 1);
+    }
+    # random: the order of @live does not matter, so swap the last in
+    $i = int(rand(@live));
+    ($live[$i], $live[-1]) = ($live[-1], $live[$i]);
+    return pop @live;
+}
+
+#
+# void free_block(void) - free the block chosen by victim()
+#
+sub free_block
+{
+    my $id = victim();
+
+    $live_bytes -= $size{$id};
+    delete $size{$id};
+    push @trace, "f $id";
+}
+
+$GEN_YOUNG = 0.1;         # the newest tenth of the live blocks ...
+$GEN_YOUNG_DEATHS = 0.9;  # ... take nine frees in ten
+
+##############
+# Main routine
+##############
+
+#
+# Parse and check the command line arguments
+#
+getopts('ho:n:d:m:M:a:b:c:l:p:r:g:s:');
+if ($opt_h) {
+    usage("");
+}
+$out_filename = $opt_o ? $opt_o : "synthetic.rep";
+$num_blocks = $opt_n ? $opt_n : 20000;
+$dist = $opt_d ? $opt_d : "power";
+$min_size = $opt_m ? $opt_m : 8;
+$max_size = $opt_M ? $opt_M : 16384;
+$alpha = $opt_a ? $opt_a : 1.2;
+$large_frac = defined($opt_b) ? $opt_b : 0.1;
+@classes = split /,/, ($opt_c ? $opt_c : "16,24,32,48,64,128,256");
+$policy = $opt_l ? $opt_l : "random";
+$peak_target = $opt_p ? $opt_p : 512 * 1024;
+$realloc_frac = $opt_r ? $opt_r : 0;
+$growth = $opt_g ? $opt_g : "*1.5";
+$seed = defined($opt_s) ? $opt_s : 1;
+
+if ($dist !~ /^(uniform|power|bimodal|classes)$/) {
+    usage("Bad size distribution: $dist");
+}
+if ($policy !~ /^(lifo|fifo|random|gen)$/) {
+    usage("Bad lifetime policy: $policy");
+}
+if ($min_size < 1 || $max_size < $min_size) {
+    usage("Need 1 <= min <= max");
+}
+grow(1);
+srand($seed);
+
+#
+# Allocate num_blocks blocks, freeing blocks whenever the next one
+# would take the live bytes past the target, and growing a random live
+# block now and then. Then free the blocks that are left.
+#
+@trace = ();
+@live = ();
+%size = ();
+$live_bytes = 0;
+$peak_bytes = 0;
+for ($id = 0; $id < $num_blocks; $id++) {
+    if ($realloc_frac && @live && rand() < $realloc_frac) {
+        $rid = $live[int(rand(@live))];
+        $newsize = grow($size{$rid});
+        $live_bytes += $newsize - $size{$rid};
+        $size{$rid} = $newsize;
+        push @trace, "r $rid $newsize";
+        $peak_bytes = $live_bytes if $live_bytes > $peak_bytes;
+    }
+
+    $blksize = block_size();
+    while (@live && $live_bytes + $blksize > $peak_target) {
+        free_block();
+    }
+    $size{$id} = $blksize;
+    $live_bytes += $blksize;
+    push @live, $id;
+    push @trace, "a $id $blksize";
+
+    $peak_bytes = $live_bytes if $live_bytes > $peak_bytes;
+}
+while (@live) {
+    free_block();
+}
+
+# Write the trace, with the peak of live bytes as the suggested heap size
+open OUTFILE, ">$out_filename" or die "Cannot create $out_filename\n";
+$num_ops = @trace;
+print OUTFILE "$peak_bytes\n";
+print OUTFILE "$num_blocks\n";
+print OUTFILE "$num_ops\n";
+print OUTFILE "1\n";
+foreach $op (@trace) {
+    print OUTFILE "$op\n";
+}
+close OUTFILE;
@@ -805,23 +805,67 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_writen */
 
-/* 
- * rio_read - This is a wrapper for the Unix read() function that
- *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
- *    buffer, where n is the number of bytes requested by the user and
- *    rio_cnt is the number of unread bytes in the internal buffer. On
- *    entry, rio_read() refills the internal buffer via a call to
- *    read() if the internal buffer is empty.
+/*
+ * rio_writevn - Robustly write every byte described by an iovec array
+ *    (unbuffered). The iovec array is modified.
  */
-/* $begin rio_read */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+static ssize_t rio_writevn(int fd, struct iovec *iov, int iovcnt)
 {
-    int cnt;
+    size_t n = 0;
+    ssize_t nwritten;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+        n += iov[i].iov_len;
+    while (iovcnt > 0)
+    {
+        if ((nwritten = writev(fd, iov, iovcnt)) <= 0)
+        {
+            if (errno == EINTR) /* Interrupted by sig handler return */
+                nwritten = 0;   /* and call writev() again */
+            else
+                return -1; /* errno set by writev() */
+        }
+        /* Skip the fully written entries and trim a partial one */
+        while (iovcnt > 0 && nwritten >= iov->iov_len)
+        {
+            nwritten -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + nwritten;
+            iov->iov_len -= nwritten;
+        }
+    }
+    return n;
+}
+
+/*
+ * rio_fill - Refill the internal buffer of rp if it is empty. Return the
+ *    number of unread bytes, 0 on EOF and -1 on error.
+ *
+ *    A buffer that was completely consumed after being filled to the brim
+ *    (rio_bufptr at its end) indicates a bulk transfer, so it is doubled up
+ *    to RIO_MAXBUFSIZE to cut the number of read() calls.
+ */
+static ssize_t rio_fill(rio_t *rp)
+{
+    size_t bufsize = 2 * rp->rio_bufsize;
+    char *buf;
 
     while (rp->rio_cnt <= 0)
     { /* Refill if buf is empty */
-        rp->rio_cnt = read(rp->rio_fd, rp->rio_buf,
-                           sizeof(rp->rio_buf));
+        if (rp->rio_bufptr == rp->rio_buf + rp->rio_bufsize &&
+            bufsize <= RIO_MAXBUFSIZE && (buf = malloc(bufsize)) != NULL)
+        {
+            rio_freeb(rp);
+            rp->rio_buf = buf;
+            rp->rio_bufsize = bufsize;
+            rp->rio_bufptr = buf;
+        }
+        rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, rp->rio_bufsize);
         if (rp->rio_cnt < 0)
         {
             if (errno != EINTR) /* Interrupted by sig handler return */
@@ -832,6 +876,25 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
         else
             rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
     }
+    return rp->rio_cnt;
+}
+
+/* 
+ * rio_read - This is a wrapper for the Unix read() function that
+ *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
+ *    buffer, where n is the number of bytes requested by the user and
+ *    rio_cnt is the number of unread bytes in the internal buffer. On
+ *    entry, rio_read() refills the internal buffer via a call to
+ *    read() if the internal buffer is empty.
+ */
+/* $begin rio_read */
+static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+{
+    ssize_t rc;
+    int cnt;
+
+    if ((rc = rio_fill(rp)) <= 0)
+        return rc;
 
     /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
     cnt = n;
@@ -846,18 +909,43 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 
 /*
  * rio_readinitb - Associate a descriptor with a read buffer and reset buffer
+ *
+ *    rio_buf starts out pointing into rp itself, so a rio_t must not be
+ *    copied by value: the copy would read the original's buffer. Pass
+ *    pointers to it instead. Reads may replace the buffer with a malloc'd
+ *    one of up to RIO_MAXBUFSIZE bytes, which leaks unless rio_freeb is
+ *    called once rp is no longer read.
  */
 /* $begin rio_readinitb */
 void rio_readinitb(rio_t *rp, int fd)
 {
     rp->rio_fd = fd;
     rp->rio_cnt = 0;
+    rp->rio_buf = rp->rio_ibuf;
+    rp->rio_bufsize = RIO_BUFSIZE;
     rp->rio_bufptr = rp->rio_buf;
 }
 /* $end rio_readinitb */
 
+/*
+ * rio_freeb - Release the internal buffer if it has grown, and drop any
+ *    unread bytes so that nothing is read from the released buffer
+ */
+void rio_freeb(rio_t *rp)
+{
+    if (rp->rio_buf != rp->rio_ibuf)
+        free(rp->rio_buf);
+    rp->rio_buf = rp->rio_ibuf;
+    rp->rio_bufsize = RIO_BUFSIZE;
+    rp->rio_bufptr = rp->rio_buf;
+    rp->rio_cnt = 0;
+}
+
 /*
  * rio_readnb - Robustly read n bytes (buffered)
+ *
+ *    Once the internal buffer is drained, a single readv() fills the rest
+ *    of the user buffer directly and reads ahead into the internal buffer.
  */
 /* $begin rio_readnb */
 ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
@@ -865,10 +953,35 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
     size_t nleft = n;
     ssize_t nread;
     char *bufp = usrbuf;
+    struct iovec iov[2];
 
     while (nleft > 0)
     {
-        if ((nread = rio_read(rp, bufp, nleft)) < 0)
+        if (rp->rio_cnt > 0)
+        {
+            nread = rio_read(rp, bufp, nleft);
+        }
+        else
+        {
+            iov[0].iov_base = bufp;
+            iov[0].iov_len = nleft;
+            iov[1].iov_base = rp->rio_buf;
+            iov[1].iov_len = rp->rio_bufsize;
+            if ((nread = readv(rp->rio_fd, iov, 2)) < 0)
+            {
+                if (errno == EINTR) /* Interrupted by sig handler return */
+                    continue;       /* and call readv() again */
+                return -1;          /* errno set by readv() */
+            }
+            if (nread > nleft)
+            {
+                /* The excess was read ahead into the internal buffer */
+                rp->rio_bufptr = rp->rio_buf;
+                rp->rio_cnt = nread - nleft;
+                nread = nleft;
+            }
+        }
+        if (nread < 0)
             return -1; /* errno set by read() */
         else if (nread == 0)
             break; /* EOF */
@@ -881,39 +994,93 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 
 /* 
  * rio_readlineb - Robustly read a text line (buffered)
+ *
+ *    The internal buffer is scanned for the newline with memchr and the
+ *    line is copied out in one piece.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
+    size_t n = 0, cnt;
+    ssize_t rc;
+    char *bufp = usrbuf, *eol = NULL;
 
-    for (n = 1; n < maxlen; n++)
+    while (eol == NULL && n + 1 < maxlen)
     {
-        if ((rc = rio_read(rp, &c, 1)) == 1)
-        {
-            *bufp++ = c;
-            if (c == '\n')
-            {
-                n++;
-                break;
-            }
-        }
+        if ((rc = rio_fill(rp)) < 0)
+            return -1; /* Error */
         else if (rc == 0)
         {
-            if (n == 1)
+            if (n == 0)
                 return 0; /* EOF, no data read */
             else
                 break; /* EOF, some data was read */
         }
-        else
-            return -1; /* Error */
+
+        cnt = maxlen - 1 - n;
+        if (rp->rio_cnt < cnt)
+            cnt = rp->rio_cnt;
+        if ((eol = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+            cnt = eol - rp->rio_bufptr + 1;
+        memcpy(bufp + n, rp->rio_bufptr, cnt);
+        rp->rio_bufptr += cnt;
+        rp->rio_cnt -= cnt;
+        n += cnt;
     }
-    *bufp = 0;
-    return n - 1;
+    bufp[n] = 0;
+    return n;
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_writeinitb - Associate a descriptor with a write buffer
+ */
+void rio_writeinitb(rio_wbuf_t *wp, int fd)
+{
+    wp->rio_fd = fd;
+    wp->rio_cnt = 0;
+}
+
+/*
+ * rio_writenb - Robustly write n bytes (buffered)
+ *
+ *    Small writes are gathered in the internal buffer. A write that does
+ *    not fit is sent together with the pending bytes in a single writev().
+ */
+ssize_t rio_writenb(rio_wbuf_t *wp, void *usrbuf, size_t n)
+{
+    struct iovec iov[2];
+
+    if (wp->rio_cnt + n <= RIO_WBUFSIZE)
+    {
+        memcpy(wp->rio_buf + wp->rio_cnt, usrbuf, n);
+        wp->rio_cnt += n;
+        return n;
+    }
+
+    iov[0].iov_base = wp->rio_buf;
+    iov[0].iov_len = wp->rio_cnt;
+    iov[1].iov_base = usrbuf;
+    iov[1].iov_len = n;
+    wp->rio_cnt = 0;
+    if (rio_writevn(wp->rio_fd, iov, 2) < 0)
+        return -1;
+    return n;
+}
+
+/*
+ * rio_flushb - Write out the pending bytes of a write buffer
+ */
+ssize_t rio_flushb(rio_wbuf_t *wp)
+{
+    ssize_t n = wp->rio_cnt;
+
+    wp->rio_cnt = 0;
+    if (n > 0 && rio_writen(wp->rio_fd, wp->rio_buf, n) != n)
+        return -1;
+    return n;
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -937,6 +1104,11 @@ void Rio_readinitb(rio_t *rp, int fd)
     rio_readinitb(rp, fd);
 }
 
+void Rio_freeb(rio_t *rp)
+{
+    rio_freeb(rp);
+}
+
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 {
     ssize_t rc;
@@ -955,6 +1127,23 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
     return rc;
 }
 
+void Rio_writeinitb(rio_wbuf_t *wp, int fd)
+{
+    rio_writeinitb(wp, fd);
+}
+
+void Rio_writenb(rio_wbuf_t *wp, void *usrbuf, size_t n)
+{
+    if (rio_writenb(wp, usrbuf, n) != n)
+        unix_error("Rio_writenb error");
+}
+
+void Rio_flushb(rio_wbuf_t *wp)
+{
+    if (rio_flushb(wp) < 0)
+        unix_error("Rio_flushb error");
+}
+
 /**********************************
  * Wrappers for Rio Package in Web
  **********************************/
@@ -991,6 +1180,18 @@ ssize_t Rio_readlineb_w(rio_t *rp, void *usrbuf, size_t maxlen)
     return rc;
 }
 
+void Rio_writenb_w(rio_wbuf_t *wp, void *usrbuf, size_t n)
+{
+    if (rio_writenb(wp, usrbuf, n) != n)
+        return;
+}
+
+void Rio_flushb_w(rio_wbuf_t *wp)
+{
+    if (rio_flushb(wp) < 0)
+        return;
+}
+
 /******************************** 
  * Client/server helper functions
  ********************************/
@@ -1056,6 +1257,25 @@ int open_clientfd(char *hostname, char *port)
  */
 /* $begin open_listenfd */
 int open_listenfd(char *port)
+{
+    return open_listenfd_opt(port, 0);
+}
+/* $end open_listenfd */
+
+/*
+ * open_listenfd_reuseport - Same as open_listenfd, but lets several
+ *     sockets bind the same port so that the kernel spreads incoming
+ *     connections across them (SO_REUSEPORT).
+ */
+int open_listenfd_reuseport(char *port)
+{
+    return open_listenfd_opt(port, 1);
+}
+
+/*
+ * open_listenfd_opt - Helper for open_listenfd and open_listenfd_reuseport
+ */
+int open_listenfd_opt(char *port, int reuseport)
 {
     struct addrinfo hints, *listp, *p;
     int listenfd, rc, optval = 1;
@@ -1081,6 +1301,9 @@ int open_listenfd(char *port)
         /* Eliminates "Address already in use" error from bind */
         setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, //line:netp:csapp:setsockopt
                    (const void *)&optval, sizeof(int));
+        if (reuseport)
+            setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                       (const void *)&optval, sizeof(int));
 
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
@@ -1105,7 +1328,6 @@ int open_listenfd(char *port)
     }
     return listenfd;
 }
-/* $end open_listenfd */
 
 /****************************************************
  * Wrappers for reentrant protocol-independent helpers
@@ -1128,4 +1350,13 @@ int Open_listenfd(char *port)
     return rc;
 }
 
+int Open_listenfd_reuseport(char *port)
+{
+    int rc;
+
+    if ((rc = open_listenfd_reuseport(port)) < 0)
+        unix_error("Open_listenfd_reuseport error");
+    return rc;
+}
+
 /* $end csapp.c */
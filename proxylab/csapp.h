@@ -20,6 +20,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <math.h>
 #include <pthread.h>
@@ -40,18 +41,31 @@
 typedef struct sockaddr SA;
 /* $end sockaddrdef */
 
-/* Persistent state for the robust I/O (Rio) package */
+/* Persistent state for the robust I/O (Rio) package; never copy it by
+   value, and release it with Rio_freeb (see rio_readinitb) */
 /* $begin rio_t */
-#define RIO_BUFSIZE 8192
+#define RIO_BUFSIZE 8192            /* Initial size of the read buffer */
+#define RIO_MAXBUFSIZE (256 * 1024) /* Read buffer grows up to this size */
 typedef struct
 {
-    int rio_fd;                /* Descriptor for this internal buf */
-    int rio_cnt;               /* Unread bytes in internal buf */
-    char *rio_bufptr;          /* Next unread byte in internal buf */
-    char rio_buf[RIO_BUFSIZE]; /* Internal buffer */
+    int rio_fd;                 /* Descriptor for this internal buf */
+    int rio_cnt;                /* Unread bytes in internal buf */
+    char *rio_bufptr;           /* Next unread byte in internal buf */
+    char *rio_buf;              /* Internal buffer, rio_ibuf until it grows */
+    size_t rio_bufsize;         /* Size of internal buffer */
+    char rio_ibuf[RIO_BUFSIZE]; /* Initial internal buffer */
 } rio_t;
 /* $end rio_t */
 
+/* Persistent state for the buffered Rio writer */
+#define RIO_WBUFSIZE 8192
+typedef struct
+{
+    int rio_fd;                 /* Descriptor for this internal buf */
+    int rio_cnt;                /* Pending bytes in internal buf */
+    char rio_buf[RIO_WBUFSIZE]; /* Internal buffer */
+} rio_wbuf_t;
+
 /* External variables */
 extern int h_errno;    /* Defined by BIND for DNS errors */
 extern char **environ; /* Defined by libc */
@@ -177,29 +191,42 @@ void V(sem_t *sem);
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
 void rio_readinitb(rio_t *rp, int fd);
+void rio_freeb(rio_t *rp);
 ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+void rio_writeinitb(rio_wbuf_t *wp, int fd);
+ssize_t rio_writenb(rio_wbuf_t *wp, void *usrbuf, size_t n);
+ssize_t rio_flushb(rio_wbuf_t *wp);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
 void Rio_writen(int fd, void *usrbuf, size_t n);
 void Rio_readinitb(rio_t *rp, int fd);
+void Rio_freeb(rio_t *rp);
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+void Rio_writeinitb(rio_wbuf_t *wp, int fd);
+void Rio_writenb(rio_wbuf_t *wp, void *usrbuf, size_t n);
+void Rio_flushb(rio_wbuf_t *wp);
 
 /* Wrappers for Rio package in web */
 ssize_t Rio_readn_w(int fd, void *usrbuf, size_t n);
 void Rio_writen_w(int fd, void *usrbuf, size_t n);
 ssize_t Rio_readnb_w(rio_t *rp, void *usrbuf, size_t n);
 ssize_t Rio_readlineb_w(rio_t *rp, void *usrbuf, size_t maxlen);
+void Rio_writenb_w(rio_wbuf_t *wp, void *usrbuf, size_t n);
+void Rio_flushb_w(rio_wbuf_t *wp);
 
 /* Reentrant protocol-independent client/server helpers */
 int open_clientfd(char *hostname, char *port);
 int open_listenfd(char *port);
+int open_listenfd_reuseport(char *port);
+int open_listenfd_opt(char *port, int reuseport);
 
 /* Wrappers for reentrant protocol-independent client/server helpers */
 int Open_clientfd(char *hostname, char *port);
 int Open_listenfd(char *port);
+int Open_listenfd_reuseport(char *port);
 
 #endif /* __CSAPP_H__ */
 /* $end csapp.h */
@@ -4,8 +4,15 @@
  * Junqi Xie @junqi-xie
  */
 
+/* CPU affinity needs the GNU extensions, whose gai_error clashes with csapp.h */
+#define _GNU_SOURCE
+#include <netdb.h>
+#define gai_error csapp_gai_error
 #include "csapp.h"
+#undef gai_error
+#include "proxy.h"
 #include <stdarg.h>
+#include <zlib.h>
 
 /*
  * Thread parameters
@@ -14,143 +21,695 @@ struct conn_info
 {
     int connfd;
     struct sockaddr_storage clientaddr; /* Enough space for any address */
+    struct shard *shard;                /* Owning shard, NULL if unsharded */
 };
 sem_t mutex; /* Mutex for logging */
 
+/*
+ * Per-core shards (enabled by -s)
+ *
+ * Each shard is pinned to one CPU and owns its listening socket (the
+ * kernel balances connections across them via SO_REUSEPORT), the
+ * connection threads it spawns and its counters, so the request path
+ * never touches another core's cache lines. A shard is allocated by its
+ * own thread after pinning, which places it on the local NUMA node.
+ */
+struct shard
+{
+    int id;
+    int cpu;                /* Core the shard is pinned to, -1 if unpinned */
+    int listenfd;
+    unsigned long requests; /* Requests served */
+    unsigned long bytes;    /* Response bytes relayed */
+} __attribute__((aligned(64)));
+struct shard **shards = NULL; /* Shards by id, for reporting only */
+int num_shards = 0;
+char *listen_port;
+
+/*
+ * Parsed fields of a request or response header
+ */
+struct header_info
+{
+    ssize_t content_length; /* Content-Length, 0 if absent */
+    int accept_gzip;        /* Accept-Encoding allows gzip */
+    int text;               /* Content-Type is text-like */
+    int encoded;            /* Content-Encoding or Transfer-Encoding is set */
+    int html;               /* Content-Type is text/html */
+    int credentials;        /* Cookie or Authorization is set */
+};
+
+/*
+ * Response compression (enabled by -z)
+ */
+#define CHUNK_HDR 8             /* Fixed-width chunk size line "%06zx\r\n" */
+ssize_t gzip_min_size = 0;      /* Smallest body to compress, 0 if disabled */
+
+/*
+ * Traffic capture (enabled by -c)
+ */
+FILE *capture_fp = NULL;      /* Capture log, NULL if capture is disabled */
+struct timeval capture_start; /* Time the capture began */
+
+/* Header lines of a request or response kept for the capture log */
+struct capture_buf
+{
+    char data[MAXBUF]; /* Null-terminated */
+    size_t len;
+    int truncated;     /* A line did not fit, it and all later ones are dropped */
+};
+
+/*
+ * Prefetching of embedded resources (enabled by -p)
+ *
+ * HTML bodies are scanned as they are relayed, and the same-origin URIs of
+ * their <img>, <script> and <link> tags are queued for the fetch threads.
+ * Each queued URI owns an entry of the prefetch buffer, which holds the
+ * complete response until the client asks for it. The fetch carries the
+ * headers that identify the client who requested the page, and the entry
+ * is served only to that client. Pages requested with credentials are not
+ * scanned, since an address may be shared by several users and their
+ * resources could be private. An entry is served once and then dropped,
+ * so the buffer never hands out stale copies.
+ */
+#define PREFETCH_QUEUE 64           /* Queued fetches, more are dropped */
+#define PREFETCH_ENTRIES 32         /* Responses held in the buffer */
+#define PREFETCH_MAX_OBJECT 102400  /* Largest response kept */
+
+enum prefetch_state
+{
+    PREFETCH_EMPTY,
+    PREFETCH_PENDING, /* Queued or being fetched */
+    PREFETCH_READY
+};
+
+struct prefetch_entry
+{
+    enum prefetch_state state;
+    char uri[MAXLINE];   /* Canonical "http://host:port/path" */
+    struct in_addr client;  /* Client whose page referenced uri */
+    char headers[MAXBUF];   /* Its identifying header lines, sent with the fetch */
+    char *response;      /* Status line, headers and body */
+    size_t len;
+    unsigned long stamp; /* Fill order, the oldest entry is evicted first */
+};
+
+int prefetch_threads = 0; /* Fetch threads, 0 if prefetching is disabled */
+struct prefetch_entry prefetch_buf[PREFETCH_ENTRIES];
+unsigned long prefetch_clock;
+pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER; /* Protects the buffer and queue */
+pthread_cond_t prefetch_done = PTHREAD_COND_INITIALIZER;   /* A pending entry was settled */
+int prefetch_queue[PREFETCH_QUEUE]; /* Circular queue of pending entries */
+int prefetch_front, prefetch_rear;
+sem_t prefetch_slots, prefetch_items;
+
+/*
+ * State of the tag scanner over one HTML body
+ */
+struct html_scan
+{
+    char hostname[MAXLINE], port[MAXLINE]; /* Origin of the page */
+    char base[MAXLINE];                    /* Directory of the page, for relative URIs */
+    char tail[MAXLINE];                    /* Unfinished tag carried over to the next block */
+    size_t len;
+    struct in_addr client;                 /* Client that requested the page */
+    char *request;                         /* Its request lines, complete before the body */
+};
+
 /*
  * Function prototypes
  */
+void usage(char *name);
 void *thread(void *vargp);
-void proxy(int connfd, struct sockaddr_in *sockaddr);
-ssize_t forward_header(rio_t *rio, int fd, ssize_t *size);
-void forward_body(rio_t *rio, int fd, ssize_t *size, ssize_t content_length);
+void *shard_thread(void *vargp);
+void sigusr1_handler(int sig);
+void proxy(int connfd, struct sockaddr_in *sockaddr, struct shard *shard);
+ssize_t forward_header(rio_t *rio, rio_wbuf_t *wp, ssize_t *size, struct capture_buf *cap,
+                       struct header_info *info);
+void forward_header_lines(rio_t *rio, rio_wbuf_t *wp, ssize_t *size, struct capture_buf *cap,
+                          struct header_info *info);
+void forward_body(rio_t *rio, rio_wbuf_t *wp, ssize_t *size, ssize_t content_length,
+                  struct html_scan *scan);
+ssize_t forward_compressed(rio_t *rio, rio_wbuf_t *wp, ssize_t *size, struct capture_buf *cap,
+                           struct html_scan *scan);
+void gzip_body(rio_t *rio, rio_wbuf_t *wp, ssize_t *size, ssize_t content_length, z_stream *zs,
+               struct html_scan *scan);
+void parse_header_line(char *line, struct header_info *info);
+int is_text_type(char *type);
 int parse_uri(char *uri, char *target_addr, char *path, char *port);
 void format_log_entry(char *logstring, struct sockaddr_in *sockaddr, char *uri, size_t size);
+void log_request(struct sockaddr_in *sockaddr, char *uri, size_t size, struct shard *shard);
+void capture_open(char *filename);
+void capture_init(struct capture_buf *cap);
+void capture_line(struct capture_buf *cap, char *line);
+void capture_write(struct capture_record *rec, char *request);
+void capture_exchange(struct capture_record *rec, struct timeval *begin,
+                      struct capture_buf *request, unsigned status, ssize_t header_size,
+                      ssize_t size);
+uint64_t elapsed_usec(struct timeval *since);
+void prefetch_init(void);
+void *prefetch_thread(void *vargp);
+char *prefetch_fetch(char *uri, char *headers, size_t *len);
+void prefetch_headers(char *dst, char *request);
+void prefetch_request(char *uri, struct html_scan *scan);
+char *prefetch_take(char *uri, struct in_addr client, size_t *len);
+int serve_prefetched(rio_t *rio, int connfd, char *uri, struct in_addr client,
+                     struct capture_buf *cap, ssize_t *header_size, ssize_t *size);
+void scan_init(struct html_scan *scan, char *hostname, char *port, char *pathname,
+               struct in_addr client, char *request);
+void scan_html(struct html_scan *scan, char *buf, size_t n);
+void scan_tag(struct html_scan *scan, char *tag);
 
 /*
  * main - Main routine for the proxy program
  */
 int main(int argc, char **argv)
 {
-    int listenfd;
+    int listenfd, c;
+    long i;
     socklen_t clientlen;
     struct conn_info *conn;
     pthread_t tid;
 
     /* Check arguments */
-    if (argc != 2)
+    while ((c = getopt(argc, argv, "c:p:s:z:")) != -1)
     {
-        fprintf(stderr, "Usage: %s <port number>\n", argv[0]);
-        exit(0);
+        switch (c)
+        {
+        case 'c': /* Record traffic into a capture log */
+            capture_open(optarg);
+            break;
+        case 'p': /* Prefetch embedded resources of HTML pages */
+            prefetch_threads = atoi(optarg);
+            break;
+        case 's': /* Run one pinned shard per core */
+            num_shards = atoi(optarg);
+            break;
+        case 'z': /* Compress text responses for gzip clients */
+            gzip_min_size = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
     }
+    if (optind != argc - 1 || num_shards < 0 || gzip_min_size < 0 || prefetch_threads < 0)
+        usage(argv[0]);
+    listen_port = argv[optind];
 
     Signal(SIGPIPE, SIG_IGN); /* Ignore SIGPIPE signals */
     Sem_init(&mutex, 0, 1); /* Initialize mutex */
-    listenfd = Open_listenfd(argv[1]);
+    if (prefetch_threads)
+        prefetch_init();
+
+    if (num_shards)
+    {
+        shards = (struct shard **)Calloc(num_shards, sizeof(struct shard *));
+        Signal(SIGUSR1, sigusr1_handler); /* Report shard counters */
+        for (i = 0; i < num_shards; ++i)
+            Pthread_create(&tid, NULL, shard_thread, (void *)i);
+        while (1)
+            pause();
+    }
+
+    listenfd = Open_listenfd(listen_port);
     while (1)
     {
         conn = (struct conn_info *)Malloc(sizeof(struct conn_info));
         clientlen = sizeof(struct sockaddr_storage);
         conn->connfd = Accept(listenfd, (SA *)&(conn->clientaddr), &clientlen);
+        conn->shard = NULL;
         Pthread_create(&tid, NULL, thread, conn);
     }
     exit(0);
 }
 
+/*
+ * usage - Print the command line arguments and exit
+ */
+void usage(char *name)
+{
+    fprintf(stderr, "Usage: %s [-c <capture file>] [-p <threads>] [-s <shards>] [-z <bytes>] <port number>\n", name);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-c <file>    Record traffic into a capture log.\n");
+    fprintf(stderr, "\t-p <threads> Prefetch resources of HTML pages with <threads> fetch threads.\n");
+    fprintf(stderr, "\t-s <shards>  Run one listener pinned to each of <shards> cores.\n");
+    fprintf(stderr, "\t-z <bytes>   Gzip text responses of at least <bytes> for gzip clients.\n");
+    exit(0);
+}
+
 void *thread(void *vargp)
 {
     struct conn_info *conn = (struct conn_info *)vargp;
     int connfd = conn->connfd;
     struct sockaddr_storage clientaddr = conn->clientaddr;
+    struct shard *shard = conn->shard;
 
     Pthread_detach(pthread_self());
     Free(vargp);
-    proxy(connfd, (struct sockaddr_in *)&(clientaddr));
+    proxy(connfd, (struct sockaddr_in *)&(clientaddr), shard);
     Close(connfd);
     return NULL;
 }
 
+/*
+ * shard_thread - Pin to a core and serve the connections accepted on
+ *     this shard's own listening socket
+ */
+void *shard_thread(void *vargp)
+{
+    long id = (long)vargp;
+    struct shard *shard;
+    struct conn_info *conn;
+    socklen_t clientlen;
+    pthread_attr_t attr;
+    cpu_set_t cpus;
+    pthread_t tid;
+    int rc, cpu, n;
+
+    Pthread_detach(pthread_self());
+
+    /*
+     * Pin first so that the shard state is allocated on the local node. The
+     * shards take turns over the CPUs the proxy is allowed to run on, which
+     * under taskset or a cpuset need not start at 0. A shard that cannot be
+     * pinned still serves, just without the locality.
+     */
+    cpu = -1;
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &cpus) == 0 && CPU_COUNT(&cpus) > 0)
+    {
+        n = id % CPU_COUNT(&cpus);
+        for (cpu = 0; !CPU_ISSET(cpu, &cpus) || n-- > 0; ++cpu)
+            ;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if ((rc = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus)) != 0)
+        {
+            fprintf(stderr, "Warning: shard %ld not pinned to cpu %d: %s\n", id, cpu,
+                    strerror(rc));
+            cpu = -1;
+        }
+    }
+    else
+        fprintf(stderr, "Warning: shard %ld not pinned: %s\n", id, strerror(errno));
+    if ((rc = posix_memalign((void **)&shard, sizeof(struct shard), sizeof(struct shard))) != 0)
+        posix_error(rc, "posix_memalign error");
+    memset(shard, 0, sizeof(struct shard));
+    shard->id = id;
+    shard->cpu = cpu;
+    shard->listenfd = Open_listenfd_reuseport(listen_port);
+    shards[id] = shard;
+
+    /* Connection threads stay on the shard's core */
+    pthread_attr_init(&attr);
+    if (cpu >= 0)
+        pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpus);
+    while (1)
+    {
+        conn = (struct conn_info *)Malloc(sizeof(struct conn_info));
+        clientlen = sizeof(struct sockaddr_storage);
+        conn->connfd = Accept(shard->listenfd, (SA *)&(conn->clientaddr), &clientlen);
+        conn->shard = shard;
+        Pthread_create(&tid, &attr, thread, conn);
+    }
+    return NULL;
+}
+
+/*
+ * sigusr1_handler - Print the counters of every shard
+ */
+void sigusr1_handler(int sig)
+{
+    int olderrno = errno;
+    int i;
+
+    for (i = 0; i < num_shards; ++i)
+    {
+        if (!shards[i])
+            continue;
+        Sio_puts("shard ");
+        Sio_putl(shards[i]->id);
+        if (shards[i]->cpu < 0)
+            Sio_puts(" unpinned: ");
+        else
+        {
+            Sio_puts(" cpu ");
+            Sio_putl(shards[i]->cpu);
+            Sio_puts(": ");
+        }
+        Sio_putl(shards[i]->requests);
+        Sio_puts(" requests, ");
+        Sio_putl(shards[i]->bytes);
+        Sio_puts(" bytes\n");
+    }
+    errno = olderrno;
+}
+
 /*
  * proxy - read and proxy web contents until client closes connection
  */
-void proxy(int connfd, struct sockaddr_in *sockaddr)
+void proxy(int connfd, struct sockaddr_in *sockaddr, struct shard *shard)
 {
     char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
     char hostname[MAXLINE], pathname[MAXLINE], port[MAXLINE];
+    struct capture_buf request, response, *reqcap = NULL, *respcap = NULL;
     int clientfd;
-    ssize_t content_length, size;
+    unsigned status;
+    ssize_t size, header_size;
+    struct header_info reqinfo, respinfo;
+    struct html_scan scan, *scanp = NULL;
+    struct capture_record rec;
+    struct timeval begin;
     rio_t connrio, clientrio;
+    rio_wbuf_t connw, clientw;
 
     Rio_readinitb(&connrio, connfd);
     if (!Rio_readlineb_w(&connrio, buf, MAXLINE))
+    {
+        Rio_freeb(&connrio);
         return;
+    }
+
+    /* Keep the original request for the capture log and the prefetcher */
+    if (capture_fp || prefetch_threads)
+    {
+        reqcap = &request;
+        capture_init(reqcap);
+        capture_line(reqcap, buf);
+    }
+    if (capture_fp)
+    {
+        gettimeofday(&begin, NULL);
+        memset(&rec, 0, sizeof(struct capture_record));
+        respcap = &response;
+        capture_init(respcap);
+    }
 
     /* Read Request Line */
     if (sscanf(buf, "%s %s %s", method, uri, version) != 3 || strcasecmp(version, "HTTP/1.1"))
     {
         fprintf(stderr, "Illegal request line\n");
+        Rio_freeb(&connrio);
         return;
     }
     if (parse_uri(uri, hostname, pathname, port))
     {
         fprintf(stderr, "Illegal URL\n");
+        Rio_freeb(&connrio);
         return;
     }
+
+    /* Serve embedded resources fetched ahead of time */
+    if (prefetch_threads && !strcasecmp(method, "GET"))
+    {
+        if (snprintf(buf, MAXLINE, "http://%s:%s/%s", hostname, port, pathname) < MAXLINE &&
+            serve_prefetched(&connrio, connfd, buf, sockaddr->sin_addr, reqcap, &header_size,
+                             &size))
+        {
+            /* Only 200 responses are prefetched */
+            if (capture_fp)
+                capture_exchange(&rec, &begin, &request, 200, header_size, size);
+            log_request(sockaddr, uri, size, shard);
+            Rio_freeb(&connrio);
+            return;
+        }
+        scanp = &scan;
+        scan_init(scanp, hostname, port, pathname, sockaddr->sin_addr, request.data);
+    }
+
     sprintf(buf, "%s /%s %s\r\n", method, pathname, version);
-    
     clientfd = Open_clientfd(hostname, port);
     Rio_readinitb(&clientrio, clientfd);
-    Rio_writen_w(clientfd, buf, strlen(buf));
+    Rio_writeinitb(&clientw, clientfd);
+    Rio_writeinitb(&connw, connfd);
+    Rio_writenb_w(&clientw, buf, strlen(buf));
 
     /* Forward from client to server */
     size = 0;
-    content_length = forward_header(&connrio, clientfd, &size);
+    memset(&reqinfo, 0, sizeof(struct header_info));
+    forward_header_lines(&connrio, &clientw, &size, reqcap, &reqinfo);
+    header_size = size;
+    if (reqinfo.credentials)
+        scanp = NULL; /* Never prefetch on behalf of a signed-in user */
     if (strcasecmp(method, "GET"))
-        forward_body(&connrio, clientfd, &size, content_length);
+        forward_body(&connrio, &clientw, &size, reqinfo.content_length, NULL);
+    Rio_flushb_w(&clientw);
+    rec.request_body = size - header_size;
 
     /* Forward from server to client */
     size = 0;
-    content_length = forward_header(&clientrio, connfd, &size);
-    forward_body(&clientrio, connfd, &size, content_length);
+    if (gzip_min_size && reqinfo.accept_gzip)
+        header_size = forward_compressed(&clientrio, &connw, &size, respcap, scanp);
+    else
+    {
+        forward_header(&clientrio, &connw, &size, respcap, &respinfo);
+        header_size = size;
+        forward_body(&clientrio, &connw, &size, respinfo.content_length,
+                     respinfo.html ? scanp : NULL);
+    }
+    Rio_flushb_w(&connw);
 
-    /* Output Log */
-    format_log_entry(buf, sockaddr, uri, size);
-    P(&mutex);
-    printf("%s\n", buf);
-    V(&mutex);
+    /* Record the exchange */
+    if (capture_fp)
+    {
+        if (sscanf(response.data, "%*s %u", &status) != 1)
+            status = 0;
+        capture_exchange(&rec, &begin, &request, status, header_size, size);
+    }
 
+    log_request(sockaddr, uri, size, shard);
     Close(clientfd);
+    Rio_freeb(&connrio);
+    Rio_freeb(&clientrio);
 }
 
-ssize_t forward_header(rio_t *rio, int fd, ssize_t *size)
+/*
+ * forward_header - relay a response's status line and its header lines up
+ *     to the empty line, parsing the headers into info, and return the
+ *     Content-Length. The lines are gathered in
+ *     wp, which the caller flushes once the message is complete. If cap is
+ *     not NULL, the lines are also appended to cap for the capture log.
+ */
+ssize_t forward_header(rio_t *rio, rio_wbuf_t *wp, ssize_t *size, struct capture_buf *cap,
+                       struct header_info *info)
 {
-    ssize_t content_length;
+    ssize_t n;
     char buf[MAXLINE];
 
-    *size += Rio_readlineb_w(rio, buf, MAXLINE);
-    Rio_writen_w(fd, buf, strlen(buf));
-    while (strcmp(buf, "\r\n"))
-    {
-        *size += Rio_readlineb_w(rio, buf, MAXLINE);
-        if (!strncmp(buf, "Content-Length: ", 16))
-            sscanf(buf, "Content-Length: %zd", &content_length);
-        Rio_writen_w(fd, buf, strlen(buf));
-    }
+    memset(info, 0, sizeof(struct header_info));
+    if ((n = Rio_readlineb_w(rio, buf, MAXLINE)) == 0)
+        return 0;
+    *size += n;
+    Rio_writenb_w(wp, buf, n);
+    if (cap)
+        capture_line(cap, buf);
+    if (strcmp(buf, "\r\n"))
+        forward_header_lines(rio, wp, size, cap, info);
 
-    return content_length;
+    return info->content_length;
 }
 
-void forward_body(rio_t *rio, int fd, ssize_t *size, ssize_t content_length)
+/*
+ * forward_header_lines - relay header lines up to the empty line, adding
+ *     their fields to info. Request headers are relayed with this directly,
+ *     since the request line has already been read.
+ */
+void forward_header_lines(rio_t *rio, rio_wbuf_t *wp, ssize_t *size, struct capture_buf *cap,
+                          struct header_info *info)
 {
+    ssize_t n;
     char buf[MAXLINE];
 
+    do
+    {
+        if ((n = Rio_readlineb_w(rio, buf, MAXLINE)) == 0)
+            break; /* EOF before the empty line */
+        *size += n;
+        parse_header_line(buf, info);
+        Rio_writenb_w(wp, buf, n);
+        if (cap)
+            capture_line(cap, buf);
+    } while (strcmp(buf, "\r\n"));
+}
+
+/*
+ * forward_body - relay content_length bytes of body. If scan is not NULL,
+ *     the body is HTML and is also scanned for resources to prefetch.
+ */
+void forward_body(rio_t *rio, rio_wbuf_t *wp, ssize_t *size, ssize_t content_length,
+                  struct html_scan *scan)
+{
+    char buf[MAXBUF];
+    ssize_t n;
+
     while (content_length > 0)
     {
-        Rio_readnb_w(rio, buf, 1);
-        ++*size;
-        --content_length;
-        Rio_writen_w(fd, buf, 1);
+        if ((n = Rio_readnb_w(rio, buf, content_length < MAXBUF ? content_length : MAXBUF)) <= 0)
+            break;
+        *size += n;
+        content_length -= n;
+        Rio_writenb_w(wp, buf, n);
+        if (scan)
+            scan_html(scan, buf, n);
+    }
+}
+
+/*
+ * forward_compressed - relay a response to a client that accepts gzip.
+ *     The header is held back until it is complete; text-like bodies of at
+ *     least gzip_min_size bytes are then gzip-compressed on the fly and sent
+ *     with chunked encoding, other bodies are relayed unchanged. Return the
+ *     size of the response header from the server.
+ */
+ssize_t forward_compressed(rio_t *rio, rio_wbuf_t *wp, ssize_t *size, struct capture_buf *cap,
+                           struct html_scan *scan)
+{
+    char header[MAXBUF], out[MAXBUF + MAXLINE], buf[MAXLINE];
+    char *line, *next, *status;
+    size_t len = 0, outlen;
+    ssize_t n, header_size;
+    struct header_info info;
+    z_stream zs;
+
+    /* Hold the header back until we know whether to compress */
+    memset(&info, 0, sizeof(struct header_info));
+    while ((n = Rio_readlineb_w(rio, buf, MAXLINE)) > 0)
+    {
+        *size += n;
+        if (cap)
+            capture_line(cap, buf);
+        if (len + n >= MAXBUF)
+        {
+            /* Too large to hold, relay the rest unchanged */
+            parse_header_line(buf, &info);
+            Rio_writenb_w(wp, header, len);
+            Rio_writenb_w(wp, buf, n);
+            if (strcmp(buf, "\r\n"))
+                forward_header_lines(rio, wp, size, cap, &info);
+            header_size = *size;
+            forward_body(rio, wp, size, info.content_length, info.html ? scan : NULL);
+            return header_size;
+        }
+        memcpy(header + len, buf, n + 1);
+        if (len)
+            parse_header_line(buf, &info);
+        len += n;
+        if (!strcmp(buf, "\r\n"))
+            break;
+    }
+    header_size = *size;
+    if (!info.html)
+        scan = NULL;
+
+    memset(&zs, 0, sizeof(z_stream));
+    if (!info.text || info.encoded || info.content_length < gzip_min_size ||
+        (status = strchr(header, ' ')) == NULL ||
+        deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        Rio_writenb_w(wp, header, len);
+        forward_body(rio, wp, size, info.content_length, scan);
+        return header_size;
+    }
+
+    /* Rewrite the header: chunked gzip body, no Content-Length */
+    outlen = sprintf(out, "HTTP/1.1");
+    for (line = status; *line && strcmp(line, "\r\n"); line = next)
+    {
+        next = strstr(line, "\r\n");
+        next = next ? next + 2 : line + strlen(line);
+        if (line != status && !strncasecmp(line, "Content-Length:", 15))
+            continue;
+        memcpy(out + outlen, line, next - line);
+        outlen += next - line;
+    }
+    outlen += sprintf(out + outlen, "Content-Encoding: gzip\r\n"
+                                    "Transfer-Encoding: chunked\r\n"
+                                    "Vary: Accept-Encoding\r\n\r\n");
+    Rio_writenb_w(wp, out, outlen);
+
+    gzip_body(rio, wp, size, info.content_length, &zs, scan);
+    deflateEnd(&zs);
+    return header_size;
+}
+
+/*
+ * gzip_body - compress content_length bytes of body with zs and relay
+ *     the output as HTTP chunks, scanning the input like forward_body
+ */
+void gzip_body(rio_t *rio, rio_wbuf_t *wp, ssize_t *size, ssize_t content_length, z_stream *zs,
+               struct html_scan *scan)
+{
+    char in[MAXBUF], out[CHUNK_HDR + MAXBUF + 2];
+    ssize_t n, len;
+    int flush;
+
+    do
+    {
+        n = 0;
+        if (content_length > 0)
+            n = Rio_readnb_w(rio, in, content_length < MAXBUF ? content_length : MAXBUF);
+        *size += n;
+        content_length -= n;
+        flush = (n <= 0 || content_length <= 0) ? Z_FINISH : Z_NO_FLUSH;
+        if (scan && n > 0)
+            scan_html(scan, in, n);
+
+        zs->next_in = (Bytef *)in;
+        zs->avail_in = n;
+        do
+        {
+            /* Leave room for the chunk size line in front of the data */
+            zs->next_out = (Bytef *)out + CHUNK_HDR;
+            zs->avail_out = MAXBUF;
+            deflate(zs, flush);
+            if ((len = MAXBUF - zs->avail_out) == 0)
+                continue; /* An empty chunk would end the body */
+            sprintf(out, "%06zx\r", len);
+            out[CHUNK_HDR - 1] = '\n';
+            memcpy(out + CHUNK_HDR + len, "\r\n", 2);
+            Rio_writenb_w(wp, out, CHUNK_HDR + len + 2);
+        } while (zs->avail_out == 0);
+    } while (flush != Z_FINISH);
+
+    Rio_writenb_w(wp, "0\r\n\r\n", 5);
+}
+
+/*
+ * parse_header_line - update info with the field on one header line
+ */
+void parse_header_line(char *line, struct header_info *info)
+{
+    if (!strncasecmp(line, "Content-Length:", 15))
+        sscanf(line + 15, "%zd", &info->content_length);
+    else if (!strncasecmp(line, "Accept-Encoding:", 16))
+        info->accept_gzip = strcasestr(line + 16, "gzip") != NULL;
+    else if (!strncasecmp(line, "Content-Type:", 13))
+    {
+        info->text = is_text_type(line + 13);
+        info->html = !strncasecmp(line + 13 + strspn(line + 13, " \t"), "text/html", 9);
     }
+    else if (!strncasecmp(line, "Content-Encoding:", 17) ||
+             !strncasecmp(line, "Transfer-Encoding:", 18))
+        info->encoded = 1;
+    else if (!strncasecmp(line, "Cookie:", 7) || !strncasecmp(line, "Authorization:", 14))
+        info->credentials = 1;
+}
+
+/*
+ * is_text_type - return whether a Content-Type value is worth compressing
+ */
+int is_text_type(char *type)
+{
+    static char *types[] = {"application/json", "application/javascript",
+                            "application/xml", "image/svg+xml", NULL};
+    char **p;
+
+    type += strspn(type, " \t");
+    if (!strncasecmp(type, "text/", 5))
+        return 1;
+    for (p = types; *p; ++p)
+        if (!strncasecmp(type, *p, strlen(*p)))
+            return 1;
+    return 0;
 }
 
 /*
@@ -222,12 +781,13 @@ void format_log_entry(char *logstring, struct sockaddr_in *sockaddr,
                       char *uri, size_t size)
 {
     time_t now;
+    struct tm tm;
     char time_str[MAXLINE];
     char host[INET_ADDRSTRLEN];
 
     /* Get a formatted time string */
     now = time(NULL);
-    strftime(time_str, MAXLINE, "%a %d %b %Y %H:%M:%S %Z", localtime(&now));
+    strftime(time_str, MAXLINE, "%a %d %b %Y %H:%M:%S %Z", localtime_r(&now, &tm));
 
     if (inet_ntop(AF_INET, &sockaddr->sin_addr, host, sizeof(host)) == NULL)
         unix_error("Convert sockaddr_in to string representation failed\n");
@@ -235,3 +795,471 @@ void format_log_entry(char *logstring, struct sockaddr_in *sockaddr,
     /* Return the formatted log entry string */
     sprintf(logstring, "%s: %s %s %zu", time_str, host, uri, size);
 }
+
+/*
+ * log_request - Print the log entry of a served request
+ */
+void log_request(struct sockaddr_in *sockaddr, char *uri, size_t size, struct shard *shard)
+{
+    char buf[MAXLINE];
+
+    format_log_entry(buf, sockaddr, uri, size);
+    if (shard)
+    {
+        /* The shard's connection threads update its counters concurrently */
+        __sync_fetch_and_add(&shard->requests, 1);
+        __sync_fetch_and_add(&shard->bytes, size);
+        strcat(buf, "\n");
+        Rio_writen_w(STDOUT_FILENO, buf, strlen(buf));
+    }
+    else
+    {
+        P(&mutex);
+        printf("%s\n", buf);
+        V(&mutex);
+    }
+}
+
+
+/*
+ * capture_open - Start recording traffic into the capture log filename
+ */
+void capture_open(char *filename)
+{
+    capture_fp = Fopen(filename, "w");
+    Fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_LEN, capture_fp);
+    gettimeofday(&capture_start, NULL);
+}
+
+/*
+ * capture_init - Empty a capture buffer
+ */
+void capture_init(struct capture_buf *cap)
+{
+    cap->data[0] = '\0';
+    cap->len = 0;
+    cap->truncated = 0;
+}
+
+/*
+ * capture_line - Append a header line to a capture buffer of at most
+ *     MAXBUF bytes. From the first line that does not fit on, lines are
+ *     dropped and the buffer is marked truncated.
+ */
+void capture_line(struct capture_buf *cap, char *line)
+{
+    size_t len = strlen(line);
+
+    if (cap->truncated || cap->len + len >= MAXBUF)
+    {
+        cap->truncated = 1;
+        return;
+    }
+    memcpy(cap->data + cap->len, line, len + 1);
+    cap->len += len;
+}
+
+/*
+ * capture_write - Append a record and its request to the capture log.
+ *     The log is flushed after every record so that it survives the
+ *     proxy being killed.
+ */
+void capture_write(struct capture_record *rec, char *request)
+{
+    P(&mutex);
+    Fwrite(rec, sizeof(struct capture_record), 1, capture_fp);
+    Fwrite(request, 1, rec->request_len, capture_fp);
+    fflush(capture_fp);
+    V(&mutex);
+}
+
+/*
+ * capture_exchange - Fill in rec for a request that began at begin and
+ *     whose response had the given status and sizes, then log it
+ */
+void capture_exchange(struct capture_record *rec, struct timeval *begin,
+                      struct capture_buf *request, unsigned status, ssize_t header_size,
+                      ssize_t size)
+{
+    rec->start_usec = (begin->tv_sec - capture_start.tv_sec) * 1000000ULL +
+                      (begin->tv_usec - capture_start.tv_usec);
+    rec->elapsed_usec = elapsed_usec(begin);
+    rec->request_len = request->len;
+    rec->flags = request->truncated ? CAPTURE_TRUNCATED : 0;
+    rec->status = status;
+    rec->header_size = header_size;
+    rec->body_size = size - header_size;
+    capture_write(rec, request->data);
+}
+
+/*
+ * elapsed_usec - Return the microseconds elapsed since a given time
+ */
+uint64_t elapsed_usec(struct timeval *since)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - since->tv_sec) * 1000000ULL +
+           (now.tv_usec - since->tv_usec);
+}
+/*
+ * prefetch_init - Start the fetch threads
+ */
+void prefetch_init(void)
+{
+    pthread_t tid;
+    int i;
+
+    Sem_init(&prefetch_slots, 0, PREFETCH_QUEUE);
+    Sem_init(&prefetch_items, 0, 0);
+    for (i = 0; i < prefetch_threads; ++i)
+        Pthread_create(&tid, NULL, prefetch_thread, NULL);
+}
+
+/*
+ * prefetch_thread - Fetch queued URIs into their prefetch buffer entries
+ */
+void *prefetch_thread(void *vargp)
+{
+    struct prefetch_entry *entry;
+    char *response;
+    size_t len = 0;
+
+    Pthread_detach(pthread_self());
+    while (1)
+    {
+        P(&prefetch_items);
+        pthread_mutex_lock(&prefetch_lock);
+        entry = &prefetch_buf[prefetch_queue[prefetch_front]];
+        prefetch_front = (prefetch_front + 1) % PREFETCH_QUEUE;
+        pthread_mutex_unlock(&prefetch_lock);
+        V(&prefetch_slots);
+
+        /* A pending entry is never reused, so its URI and headers are stable */
+        response = prefetch_fetch(entry->uri, entry->headers, &len);
+
+        pthread_mutex_lock(&prefetch_lock);
+        entry->response = response;
+        entry->len = len;
+        entry->state = response ? PREFETCH_READY : PREFETCH_EMPTY;
+        entry->stamp = ++prefetch_clock;
+        pthread_cond_broadcast(&prefetch_done);
+        pthread_mutex_unlock(&prefetch_lock);
+    }
+    return NULL;
+}
+
+/*
+ * prefetch_fetch - GET uri from its origin with the given header lines.
+ *     Return the complete response in a malloc'd buffer, or NULL if the
+ *     request failed, the status is not 200 or the response exceeds
+ *     PREFETCH_MAX_OBJECT bytes.
+ */
+char *prefetch_fetch(char *uri, char *headers, size_t *len)
+{
+    char hostname[MAXLINE], pathname[MAXLINE], port[MAXLINE], buf[MAXBUF];
+    char *response;
+    struct header_info info;
+    ssize_t n;
+    int fd, status = 0, complete = 0;
+    rio_t rio;
+
+    if (parse_uri(uri, hostname, pathname, port) || (fd = open_clientfd(hostname, port)) < 0)
+        return NULL;
+
+    /* HTTP/1.0 makes the origin close the connection after the body */
+    if (snprintf(buf, MAXBUF, "GET /%s HTTP/1.0\r\nHost: %s:%s\r\n%s\r\n", pathname, hostname,
+                 port, headers) >= MAXBUF)
+    {
+        Close(fd);
+        return NULL;
+    }
+    Rio_writen_w(fd, buf, strlen(buf));
+
+    Rio_readinitb(&rio, fd);
+    response = Malloc(PREFETCH_MAX_OBJECT + 1);
+    memset(&info, 0, sizeof(struct header_info));
+    *len = 0;
+    while (!complete && (n = Rio_readlineb_w(&rio, buf, MAXLINE)) > 0)
+    {
+        if (*len + n > PREFETCH_MAX_OBJECT)
+            break;
+        if (*len)
+            parse_header_line(buf, &info);
+        else
+            sscanf(buf, "%*s %d", &status);
+        memcpy(response + *len, buf, n);
+        *len += n;
+        complete = !strcmp(buf, "\r\n");
+    }
+
+    /* Read the body up to EOF; one byte more than fits means too large */
+    n = -1;
+    if (complete && status == 200)
+        n = Rio_readnb_w(&rio, response + *len, PREFETCH_MAX_OBJECT + 1 - *len);
+    Rio_freeb(&rio);
+    Close(fd);
+    if (n < 0 || *len + n > PREFETCH_MAX_OBJECT ||
+        (info.content_length && n != info.content_length))
+    {
+        Free(response);
+        return NULL;
+    }
+    *len += n;
+    return response;
+}
+
+/*
+ * prefetch_headers - Copy to dst the header lines of request that identify
+ *     the client to the origin. The request line and all other fields are
+ *     left out, since they describe the page rather than its resources.
+ */
+void prefetch_headers(char *dst, char *request)
+{
+    static char *fields[] = {"User-Agent:", "Accept-Language:", NULL};
+    char *line, *next;
+    size_t len = 0;
+    int i;
+
+    if ((line = strstr(request, "\r\n")) != NULL)
+    {
+        for (line += 2; (next = strstr(line, "\r\n")) != NULL; line = next + 2)
+        {
+            for (i = 0; fields[i] && strncasecmp(line, fields[i], strlen(fields[i])); ++i)
+                ;
+            if (fields[i] && len + (next + 2 - line) < MAXBUF)
+            {
+                memcpy(dst + len, line, next + 2 - line);
+                len += next + 2 - line;
+            }
+        }
+    }
+    dst[len] = '\0';
+}
+
+/*
+ * prefetch_request - Queue uri for prefetching on behalf of the client of
+ *     scan unless it is already buffered or on its way. The entry taken is an empty one or else
+ *     the oldest ready one; if every entry is pending or the queue is
+ *     full, the request is dropped.
+ */
+void prefetch_request(char *uri, struct html_scan *scan)
+{
+    struct prefetch_entry *entry, *victim = NULL;
+    int i;
+
+    pthread_mutex_lock(&prefetch_lock);
+    for (i = 0; i < PREFETCH_ENTRIES; ++i)
+    {
+        entry = &prefetch_buf[i];
+        if (entry->state == PREFETCH_EMPTY)
+            victim = entry;
+        else if (!strcmp(entry->uri, uri) && entry->client.s_addr == scan->client.s_addr)
+        {
+            pthread_mutex_unlock(&prefetch_lock);
+            return;
+        }
+        else if (entry->state == PREFETCH_READY &&
+                 (!victim || (victim->state == PREFETCH_READY && entry->stamp < victim->stamp)))
+            victim = entry;
+    }
+    if (!victim || sem_trywait(&prefetch_slots) < 0)
+    {
+        pthread_mutex_unlock(&prefetch_lock);
+        return;
+    }
+
+    if (victim->state == PREFETCH_READY)
+        Free(victim->response);
+    victim->state = PREFETCH_PENDING;
+    victim->response = NULL;
+    strcpy(victim->uri, uri);
+    victim->client = scan->client;
+    prefetch_headers(victim->headers, scan->request);
+    prefetch_queue[prefetch_rear] = victim - prefetch_buf;
+    prefetch_rear = (prefetch_rear + 1) % PREFETCH_QUEUE;
+    pthread_mutex_unlock(&prefetch_lock);
+    V(&prefetch_items);
+}
+
+/*
+ * prefetch_take - Remove the response for uri prefetched for client from the
+ *     prefetch buffer and return it, or NULL if there is none. If the fetch
+ *     is still under way, wait for it rather than going to the origin a
+ *     second time.
+ */
+char *prefetch_take(char *uri, struct in_addr client, size_t *len)
+{
+    struct prefetch_entry *entry;
+    char *response = NULL;
+    int i;
+
+    pthread_mutex_lock(&prefetch_lock);
+    for (i = 0; i < PREFETCH_ENTRIES; ++i)
+    {
+        entry = &prefetch_buf[i];
+        if (entry->state == PREFETCH_EMPTY || strcmp(entry->uri, uri) ||
+            entry->client.s_addr != client.s_addr)
+            continue;
+        while (entry->state == PREFETCH_PENDING)
+            pthread_cond_wait(&prefetch_done, &prefetch_lock);
+        if (entry->state == PREFETCH_READY && !strcmp(entry->uri, uri) &&
+            entry->client.s_addr == client.s_addr)
+        {
+            response = entry->response;
+            *len = entry->len;
+            entry->state = PREFETCH_EMPTY;
+            entry->response = NULL;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+    return response;
+}
+
+/*
+ * serve_prefetched - Answer a GET for uri from the prefetch buffer if it
+ *     was prefetched for client. The request headers are drained from rio,
+ *     since they are not forwarded, and appended to cap if it is not NULL.
+ *     Return 1 if the request was served, 0 if uri was not prefetched.
+ */
+int serve_prefetched(rio_t *rio, int connfd, char *uri, struct in_addr client,
+                     struct capture_buf *cap, ssize_t *header_size, ssize_t *size)
+{
+    char buf[MAXLINE], *response, *end;
+    size_t len;
+
+    if ((response = prefetch_take(uri, client, &len)) == NULL)
+        return 0;
+    while (Rio_readlineb_w(rio, buf, MAXLINE) > 0)
+    {
+        if (cap)
+            capture_line(cap, buf);
+        if (!strcmp(buf, "\r\n"))
+            break;
+    }
+    Rio_writen_w(connfd, response, len);
+    end = memmem(response, len, "\r\n\r\n", 4);
+    *header_size = end ? end + 4 - response : (ssize_t)len;
+    *size = len;
+    Free(response);
+    return 1;
+}
+
+/*
+ * scan_init - Prepare to scan the HTML page at http://hostname:port/pathname
+ *     requested by client with the request lines gathered in request
+ */
+void scan_init(struct html_scan *scan, char *hostname, char *port, char *pathname,
+               struct in_addr client, char *request)
+{
+    char *p;
+
+    strcpy(scan->hostname, hostname);
+    strcpy(scan->port, port);
+    scan->client = client;
+    scan->request = request;
+    snprintf(scan->base, MAXLINE, "http://%s:%s/%s", hostname, port, pathname);
+    if ((p = strchr(scan->base + 7, '?')) != NULL)
+        *p = '\0';
+    if ((p = strrchr(scan->base + 7, '/')) != NULL)
+        p[1] = '\0';
+    scan->len = 0;
+}
+
+/*
+ * scan_html - Scan the next n bytes of an HTML body for tags. A tag split
+ *     across blocks is carried over and completed by the next call.
+ */
+void scan_html(struct html_scan *scan, char *buf, size_t n)
+{
+    char work[MAXLINE + MAXBUF + 1];
+    char *p, *lt, *gt, *end;
+
+    memcpy(work, scan->tail, scan->len);
+    memcpy(work + scan->len, buf, n);
+    end = work + scan->len + n;
+    *end = '\0';
+    scan->len = 0;
+
+    for (p = work; (lt = memchr(p, '<', end - p)) != NULL; p = gt + 1)
+    {
+        if ((gt = memchr(lt, '>', end - lt)) == NULL)
+        {
+            /* Tags longer than a line are not worth carrying */
+            if (end - lt < MAXLINE)
+            {
+                scan->len = end - lt;
+                memcpy(scan->tail, lt, scan->len);
+            }
+            return;
+        }
+        *gt = '\0';
+        scan_tag(scan, lt + 1);
+    }
+}
+
+/*
+ * scan_tag - Queue the resource referenced by an <img>, <script> or <link>
+ *     tag (given without its angle brackets) if it is on the page's origin
+ */
+void scan_tag(struct html_scan *scan, char *tag)
+{
+    char hostname[MAXLINE], pathname[MAXLINE], port[MAXLINE];
+    char ref[MAXLINE], uri[MAXLINE];
+    char *attr, *p, *value = NULL, *end;
+    size_t len;
+    int n;
+
+    if (!strncasecmp(tag, "img", 3) && isspace((unsigned char)tag[3]))
+        attr = "src";
+    else if (!strncasecmp(tag, "script", 6) && isspace((unsigned char)tag[6]))
+        attr = "src";
+    else if (!strncasecmp(tag, "link", 4) && isspace((unsigned char)tag[4]))
+        attr = "href";
+    else
+        return;
+
+    /* Find attr=value, allowing blanks around the '=' */
+    len = strlen(attr);
+    for (p = tag; (p = strcasestr(p, attr)) != NULL; p += len)
+    {
+        if (!isspace((unsigned char)p[-1]))
+            continue;
+        value = p + len + strspn(p + len, " \t\r\n");
+        if (*value == '=')
+            break;
+    }
+    if (p == NULL)
+        return;
+    value += 1 + strspn(value + 1, " \t\r\n");
+    if (*value == '"' || *value == '\'')
+    {
+        end = strchr(value + 1, *value);
+        ++value;
+    }
+    else
+        end = value + strcspn(value, " \t\r\n");
+    if (end == NULL || end == value || end - value >= MAXLINE)
+        return;
+    memcpy(ref, value, end - value);
+    ref[end - value] = '\0';
+    ref[strcspn(ref, "#")] = '\0';
+
+    /* Resolve the reference against the page, dropping URIs too long to hold */
+    if (!strncmp(ref, "//", 2))
+        n = snprintf(uri, MAXLINE, "http:%s", ref);
+    else if (*ref == '/')
+        n = snprintf(uri, MAXLINE, "http://%s:%s%s", scan->hostname, scan->port, ref);
+    else if (ref[strcspn(ref, ":/?")] == ':')
+        n = strlen(strcpy(uri, ref)); /* Absolute, only http:// passes parse_uri */
+    else
+        n = snprintf(uri, MAXLINE, "%s%s", scan->base, ref);
+
+    if (n >= MAXLINE || parse_uri(uri, hostname, pathname, port) ||
+        strcasecmp(hostname, scan->hostname) || strcmp(port, scan->port))
+        return;
+    if (snprintf(uri, MAXLINE, "http://%s:%s/%s", hostname, port, pathname) < MAXLINE)
+        prefetch_request(uri, scan);
+}
@@ -0,0 +1,38 @@
+/*
+ * proxy.h - Definitions shared by the proxy and its tools
+ *
+ * Junqi Xie @junqi-xie
+ */
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include <stdint.h>
+
+/*
+ * Capture log format
+ *
+ * A capture log starts with the CAPTURE_MAGIC string, followed by one
+ * record per proxied request. Each record is a struct capture_record
+ * immediately followed by request_len bytes holding the original request
+ * line and request headers (including the terminating empty line). If
+ * CAPTURE_TRUNCATED is set, the headers did not fit in MAXBUF bytes and
+ * only the lines before the first one that did not fit were kept.
+ */
+#define CAPTURE_MAGIC "PXCAP002"
+#define CAPTURE_MAGIC_LEN 8
+
+#define CAPTURE_TRUNCATED 0x1 /* Request headers were cut short */
+
+struct capture_record
+{
+    uint64_t start_usec;   /* Arrival time relative to capture start */
+    uint32_t elapsed_usec; /* Time until the response was relayed */
+    uint32_t request_len;  /* Bytes of request line and headers that follow */
+    uint32_t request_body; /* Bytes of request body */
+    uint32_t status;       /* Response status code */
+    uint32_t header_size;  /* Bytes of response headers */
+    uint32_t body_size;    /* Bytes of response body */
+    uint32_t flags;        /* CAPTURE_* bits */
+};
+
+#endif /* __PROXY_H__ */
@@ -0,0 +1,391 @@
+/*
+ * replay.c - Replay a proxy capture log as a repeatable benchmark
+ *
+ * Every captured request is re-issued through the proxy at its recorded
+ * arrival time (optionally compressed by a speedup factor). The requests
+ * are redirected to a stand-in origin run by the replayer itself, which
+ * answers each one with headers and a body of the recorded sizes.
+ *
+ * Junqi Xie @junqi-xie
+ */
+
+#include "csapp.h"
+#include "proxy.h"
+
+/*
+ * Captured requests and their replay results
+ */
+struct replay_entry
+{
+    struct capture_record rec;
+    char *request;         /* Original request line and headers */
+    uint64_t latency_usec; /* Measured response time */
+    ssize_t received;      /* Bytes relayed back, 0 if the request failed */
+};
+struct replay_entry *entries;
+int num_entries;
+
+char *proxy_host, *proxy_port, *origin_port;
+sem_t done; /* Counts finished requests */
+char filler[MAXBUF]; /* Synthesized body bytes */
+
+/*
+ * Function prototypes
+ */
+void load_capture(char *filename);
+void *origin(void *vargp);
+void *origin_thread(void *vargp);
+void *replay_thread(void *vargp);
+void build_request(struct replay_entry *entry, int id, char *buf);
+void write_filler(int fd, size_t n);
+void print_summary(uint64_t wall_usec, double speedup);
+int compare_u64(const void *a, const void *b);
+uint64_t elapsed_usec(struct timeval *since);
+
+/*
+ * main - Main routine for the replayer
+ */
+int main(int argc, char **argv)
+{
+    int i, c, listenfd;
+    double speedup = 1.0;
+    uint64_t target, now;
+    struct timeval start;
+    pthread_t tid;
+
+    while ((c = getopt(argc, argv, "s:")) != -1)
+    {
+        switch (c)
+        {
+        case 's': /* Compress inter-arrival times */
+            speedup = atof(optarg);
+            break;
+        default:
+            optind = argc;
+        }
+    }
+    if (optind != argc - 4 || speedup <= 0)
+    {
+        fprintf(stderr, "Usage: %s [-s <speedup>] <capture file> <proxy host> <proxy port> <origin port>\n", argv[0]);
+        exit(0);
+    }
+    proxy_host = argv[optind + 1];
+    proxy_port = argv[optind + 2];
+    origin_port = argv[optind + 3];
+
+    Signal(SIGPIPE, SIG_IGN); /* Ignore SIGPIPE signals */
+    Sem_init(&done, 0, 0);
+    memset(filler, 'x', MAXBUF);
+    load_capture(argv[optind]);
+
+    /* Start the stand-in origin */
+    listenfd = Open_listenfd(origin_port);
+    Pthread_create(&tid, NULL, origin, (void *)(long)listenfd);
+
+    /* Issue every request at its (scaled) recorded arrival time */
+    gettimeofday(&start, NULL);
+    for (i = 0; i < num_entries; ++i)
+    {
+        target = entries[i].rec.start_usec / speedup;
+        now = elapsed_usec(&start);
+        if (target > now)
+            usleep(target - now);
+        Pthread_create(&tid, NULL, replay_thread, (void *)(long)i);
+    }
+    for (i = 0; i < num_entries; ++i)
+        P(&done);
+
+    print_summary(elapsed_usec(&start), speedup);
+    exit(0);
+}
+
+/*
+ * load_capture - Read every record of a capture log into entries
+ */
+void load_capture(char *filename)
+{
+    FILE *fp = Fopen(filename, "rb");
+    char magic[CAPTURE_MAGIC_LEN];
+    struct capture_record rec;
+    int capacity = 64;
+
+    if (fread(magic, 1, CAPTURE_MAGIC_LEN, fp) != CAPTURE_MAGIC_LEN ||
+        memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN))
+        app_error("Not a capture log");
+
+    entries = Malloc(capacity * sizeof(struct replay_entry));
+    while (fread(&rec, sizeof(struct capture_record), 1, fp) == 1)
+    {
+        if (num_entries == capacity)
+        {
+            capacity *= 2;
+            entries = Realloc(entries, capacity * sizeof(struct replay_entry));
+        }
+        entries[num_entries].rec = rec;
+        entries[num_entries].request = Malloc(rec.request_len + 1);
+        if (fread(entries[num_entries].request, 1, rec.request_len, fp) != rec.request_len)
+        {
+            Free(entries[num_entries].request); /* Truncated record */
+            break;
+        }
+        entries[num_entries].request[rec.request_len] = '\0';
+        entries[num_entries].latency_usec = 0;
+        entries[num_entries].received = 0;
+        ++num_entries;
+    }
+    Fclose(fp);
+}
+
+/*
+ * origin - Accept loop of the stand-in origin
+ */
+void *origin(void *vargp)
+{
+    int listenfd = (int)(long)vargp;
+    int connfd;
+    pthread_t tid;
+
+    Pthread_detach(pthread_self());
+    while (1)
+    {
+        connfd = Accept(listenfd, NULL, NULL);
+        Pthread_create(&tid, NULL, origin_thread, (void *)(long)connfd);
+    }
+    return NULL;
+}
+
+/*
+ * origin_thread - Answer one request with the recorded response sizes
+ */
+void *origin_thread(void *vargp)
+{
+    int connfd = (int)(long)vargp;
+    int id = -1;
+    ssize_t content_length = 0, n;
+    size_t len, pad, left;
+    char buf[MAXBUF], line[MAXLINE];
+    struct capture_record *rec;
+    rio_t rio;
+
+    Pthread_detach(pthread_self());
+    Rio_readinitb(&rio, connfd);
+    while ((n = Rio_readlineb_w(&rio, line, MAXLINE)) > 0 && strcmp(line, "\r\n"))
+    {
+        sscanf(line, "X-Replay-Id: %d", &id);
+        sscanf(line, "Content-Length: %zd", &content_length);
+    }
+
+    /* Drain the request body */
+    while (content_length > 0 &&
+           (n = Rio_readnb_w(&rio, buf, content_length < MAXBUF ? content_length : MAXBUF)) > 0)
+        content_length -= n;
+
+    if (id < 0 || id >= num_entries || !entries[id].rec.status)
+    {
+        sprintf(buf, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+        Rio_writen_w(connfd, buf, strlen(buf));
+        Rio_freeb(&rio);
+        Close(connfd);
+        return NULL;
+    }
+
+    /*
+     * Pad the headers up to the recorded header size with X-Replay-Pad
+     * lines short enough for the proxy to read whole, writing buf out
+     * whenever it fills. A gap too small for even an empty pad line is
+     * left unfilled.
+     */
+    rec = &entries[id].rec;
+    len = sprintf(buf, "HTTP/1.1 %u Replayed\r\nContent-Length: %u\r\n",
+                  rec->status, rec->body_size);
+    pad = strlen("X-Replay-Pad: \r\n");
+    left = rec->header_size > len + 2 ? rec->header_size - len - 2 : 0;
+    while (left >= pad)
+    {
+        n = left < MAXLINE / 2 ? left : MAXLINE / 2;
+        if (left - n > 0 && left - n < pad)
+            n -= pad; /* Leave room for a last line */
+        if (len + n + 2 > MAXBUF)
+        {
+            Rio_writen_w(connfd, buf, len);
+            len = 0;
+        }
+        len += sprintf(buf + len, "X-Replay-Pad: %.*s\r\n", (int)(n - pad), filler);
+        left -= n;
+    }
+    strcpy(buf + len, "\r\n");
+    Rio_writen_w(connfd, buf, len + 2);
+    write_filler(connfd, rec->body_size);
+    Rio_freeb(&rio);
+    Close(connfd);
+    return NULL;
+}
+
+/*
+ * replay_thread - Issue one captured request through the proxy and
+ *     time the response
+ */
+void *replay_thread(void *vargp)
+{
+    int id = (int)(long)vargp;
+    struct replay_entry *entry = &entries[id];
+    ssize_t content_length = -1, received = 0, n;
+    char buf[MAXBUF], line[MAXLINE];
+    struct timeval begin;
+    rio_t rio;
+    int fd;
+
+    Pthread_detach(pthread_self());
+    build_request(entry, id, buf);
+    gettimeofday(&begin, NULL);
+    if ((fd = open_clientfd(proxy_host, proxy_port)) < 0)
+    {
+        V(&done);
+        return NULL;
+    }
+    Rio_writen_w(fd, buf, strlen(buf));
+    write_filler(fd, entry->rec.request_body);
+
+    /* Read the response headers and body, up to EOF if the body has no
+       Content-Length (a chunked response from a proxy run with -z) */
+    Rio_readinitb(&rio, fd);
+    while ((n = Rio_readlineb_w(&rio, line, MAXLINE)) > 0)
+    {
+        received += n;
+        sscanf(line, "Content-Length: %zd", &content_length);
+        if (!strcmp(line, "\r\n"))
+            break;
+    }
+    while (content_length != 0 &&
+           (n = Rio_readnb_w(&rio, buf, content_length < 0 || content_length > MAXBUF ?
+                                            MAXBUF : content_length)) > 0)
+    {
+        received += n;
+        if (content_length > 0)
+            content_length -= n;
+    }
+
+    entry->latency_usec = elapsed_usec(&begin);
+    entry->received = received;
+    Rio_freeb(&rio);
+    Close(fd);
+    V(&done);
+    return NULL;
+}
+
+/*
+ * build_request - Rewrite a captured request so that it is sent to the
+ *     stand-in origin and tagged with its entry id
+ */
+void build_request(struct replay_entry *entry, int id, char *buf)
+{
+    char method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    char *line, *next, *path;
+    size_t len;
+
+    *method = *uri = *version = '\0';
+    sscanf(entry->request, "%s %s %s", method, uri, version);
+    path = strstr(uri, "://");
+    path = path ? strchr(path + 3, '/') : NULL;
+    len = sprintf(buf, "%s http://localhost:%s%s %s\r\n",
+                  method, origin_port, path ? path : "/", version);
+
+    /* Copy the headers, replacing Host and tagging the request */
+    line = strstr(entry->request, "\r\n");
+    line = line ? line + 2 : entry->request + strlen(entry->request);
+    for (; *line && strncmp(line, "\r\n", 2); line = next)
+    {
+        next = strstr(line, "\r\n");
+        next = next ? next + 2 : line + strlen(line);
+        if (!strncasecmp(line, "Host:", 5) || len + (next - line) + MAXLINE > MAXBUF)
+            continue;
+        memcpy(buf + len, line, next - line);
+        len += next - line;
+    }
+    sprintf(buf + len, "Host: localhost:%s\r\nX-Replay-Id: %d\r\n\r\n", origin_port, id);
+}
+
+/*
+ * write_filler - Write n synthesized bytes to fd
+ */
+void write_filler(int fd, size_t n)
+{
+    size_t chunk;
+
+    while (n > 0)
+    {
+        chunk = n < MAXBUF ? n : MAXBUF;
+        Rio_writen_w(fd, filler, chunk);
+        n -= chunk;
+    }
+}
+
+/*
+ * print_summary - Compare replayed latencies against the captured ones
+ */
+void print_summary(uint64_t wall_usec, double speedup)
+{
+    uint64_t *replayed = Malloc(num_entries * sizeof(uint64_t) + 1);
+    uint64_t *captured = Malloc(num_entries * sizeof(uint64_t) + 1);
+    uint64_t replayed_sum = 0, captured_sum = 0;
+    size_t bytes = 0;
+    int i, n = 0, failed = 0, truncated = 0;
+
+    for (i = 0; i < num_entries; ++i)
+    {
+        if (entries[i].rec.flags & CAPTURE_TRUNCATED)
+            ++truncated;
+        if (!entries[i].received)
+        {
+            ++failed;
+            continue;
+        }
+        replayed[n] = entries[i].latency_usec;
+        captured[n] = entries[i].rec.elapsed_usec;
+        replayed_sum += replayed[n];
+        captured_sum += captured[n];
+        bytes += entries[i].received;
+        ++n;
+    }
+    qsort(replayed, n, sizeof(uint64_t), compare_u64);
+    qsort(captured, n, sizeof(uint64_t), compare_u64);
+
+    printf("Replayed %d requests (%d failed) in %.3f s at %.1fx speed\n",
+           num_entries, failed, wall_usec / 1e6, speedup);
+    if (truncated)
+        printf("%d requests had headers cut short in the capture\n", truncated);
+    if (!n)
+    {
+        Free(replayed);
+        Free(captured);
+        return;
+    }
+    printf("Received %zu bytes (%.1f requests/s)\n", bytes, num_entries / (wall_usec / 1e6));
+    printf("%10s %10s %10s %10s %10s\n", "usec", "mean", "p50", "p99", "max");
+    printf("%10s %10lu %10lu %10lu %10lu\n", "replayed",
+           (unsigned long)(replayed_sum / n), (unsigned long)replayed[n / 2],
+           (unsigned long)replayed[n * 99 / 100], (unsigned long)replayed[n - 1]);
+    printf("%10s %10lu %10lu %10lu %10lu\n", "captured",
+           (unsigned long)(captured_sum / n), (unsigned long)captured[n / 2],
+           (unsigned long)captured[n * 99 / 100], (unsigned long)captured[n - 1]);
+    Free(replayed);
+    Free(captured);
+}
+
+int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * elapsed_usec - Return the microseconds elapsed since a given time
+ */
+uint64_t elapsed_usec(struct timeval *since)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - since->tv_sec) * 1000000ULL +
+           (now.tv_usec - since->tv_usec);
+}